@@ -4,6 +4,7 @@ import threading
 import queue
 import time
 import os
+import tracing
 
 # Import GStreamer libraries
 import gi
@@ -16,7 +17,7 @@ class AudioPlayerPool:
     Each worker grabs an id from a queue and plays the associated audio from
     the audio_files dictionary, allowing sounds to overlay.
     """
-    def __init__(self, audio_files, num_workers=4, verbose=False):
+    def __init__(self, audio_files, num_workers=4, verbose=False, trace=None):
         # Initialize GStreamer
         Gst.init(None)
 
@@ -24,6 +25,7 @@ class AudioPlayerPool:
         self.task_queue = queue.Queue()
         self.audio_files = audio_files
         self.verbose = verbose
+        self.trace = trace
         self.workers = []
 
         print(f"Starting audio pool with {self.num_workers} worker threads...")
@@ -41,15 +43,20 @@ class AudioPlayerPool:
         """The main loop for each worker thread."""
         if self.verbose:
             print(f"Worker {worker_id}: Ready for tasks.")
+        if self.trace:
+            self.trace.thread(f"audio worker {worker_id}")
         while True:
             # Block and wait for a sound id from the queue
-            id = self.task_queue.get()
+            task = self.task_queue.get()
 
             # A 'None' sentinel value is used to signal the thread to exit
-            if id is None:
+            if task is None:
                 print(f"Worker {worker_id}: Received shutdown signal. Exiting.")
                 break
 
+            id, trace_args, queued = task
+            started = tracing.now()
+
             if self.verbose:
                 print(f"Worker {worker_id}: Playing sound {id}")
 
@@ -96,6 +103,13 @@ class AudioPlayerPool:
                 print("Starting pipeline...")
             pipeline.set_state(Gst.State.PLAYING)
 
+            # Time spent waiting for a free worker, then getting the voice going
+            if self.trace and trace_args:
+                self.trace.event("voice queued", "sound", queued, started,
+                                 flow=tracing.FLOW_IN | tracing.FLOW_OUT, args=trace_args)
+                self.trace.event("voice started", "sound", started, tracing.now(),
+                                 flow=tracing.FLOW_IN, args=trace_args)
+
             try:
                 loop.run()
             finally:
@@ -105,10 +119,10 @@ class AudioPlayerPool:
                 pipeline.set_state(Gst.State.NULL)
 
 
-    def play_sound(self, id):
+    def play_sound(self, id, trace_args=None):
         if self.verbose:
             print(f"Main: Queuing sound -> {id}")
-        self.task_queue.put(id)
+        self.task_queue.put((id, trace_args, tracing.now()))
 
 
     def stop(self):
@@ -0,0 +1,543 @@
+#!/usr/bin/env python3
+"""
+Benchmarks for the input clients.
+
+Each benchmark runs a client against a local TCP sink standing in for the
+forwarder, with a FIFO full of input events standing in for the device. The
+throughput benchmark can use a uinput device instead, so the events take
+the real evdev path. Its latencies run from each event's timestamp, as the
+client would see it, to the frame reaching the sink.
+"""
+
+import argparse
+import fcntl
+import os
+import select
+import socket
+import statistics
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+from typing import Optional
+
+PRESS_IDENTIFIER = 254
+RELEASE_IDENTIFIER = 255
+PRESS_EXTENDED_IDENTIFIER = 248
+RELEASE_EXTENDED_IDENTIFIER = 247
+
+EV_SYN = 0x00
+EV_KEY = 0x01
+SYN_REPORT = 0
+KEY_A = 30
+# Chords are made from the letter keys. Each press and release of a chord
+# moves on through them, so an event's code and direction only repeat well
+# after it has been forwarded.
+CHORD_KEYS = list(range(16, 26)) + list(range(30, 39)) + list(range(44, 51))
+MAX_CHORD = 10
+
+INPUT_EVENT_FORMAT = 'QQHHi'
+
+# From linux/uinput.h
+UINPUT_DEVICE = "/dev/uinput"
+UI_DEV_CREATE = 0x5501
+UI_DEV_DESTROY = 0x5502
+UI_DEV_SETUP = 0x405c5503
+UI_SET_EVBIT = 0x40045564
+UI_SET_KEYBIT = 0x40045565
+UI_GET_SYSNAME_64 = 0x8040552c
+BUS_VIRTUAL = 0x06
+# struct uinput_setup: struct input_id, name, ff_effects_max
+UINPUT_SETUP_FORMAT = 'HHHH80sI'
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def input_event(event_type: int, code: int, value: int, now: Optional[float] = None) -> bytes:
+    """Pack an input event stamped with now, or the current time."""
+    if now is None:
+        now = time.time()
+    return struct.pack(INPUT_EVENT_FORMAT, int(now), int(now % 1 * 1000000),
+                       event_type, code, value)
+
+
+class Sink:
+    """Listening socket that plays the forwarder."""
+    def __init__(self):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.bind(("127.0.0.1", 0))
+        self.sock.listen(1)
+        self.port = self.sock.getsockname()[1]
+
+    def accept(self, timeout: float) -> Optional[socket.socket]:
+        ready, _, _ = select.select([self.sock], [], [], timeout)
+        if not ready:
+            return None
+        conn, _ = self.sock.accept()
+        return conn
+
+
+class Receiver:
+    """Thread noting each key frame that arrives at the sink, as its code,
+    whether it is a press and the wall clock time it arrived."""
+    def __init__(self, conn: socket.socket):
+        self.conn = conn
+        self.frames = []
+        self.thread = threading.Thread(target=self._run, daemon=True)
+        self.thread.start()
+
+    def _run(self) -> None:
+        data = b''
+        while True:
+            try:
+                chunk = self.conn.recv(65536)
+            except OSError:
+                return
+            if not chunk:
+                return
+            now = time.time()
+            data += chunk
+            i = 0
+            while i + 2 <= len(data):
+                identifier = data[i]
+                if identifier in (PRESS_EXTENDED_IDENTIFIER, RELEASE_EXTENDED_IDENTIFIER):
+                    if i + 3 > len(data):
+                        break
+                    code = data[i + 1] << 8 | data[i + 2]
+                    self.frames.append((code, identifier == PRESS_EXTENDED_IDENTIFIER, now))
+                    i += 3
+                    continue
+                if identifier in (PRESS_IDENTIFIER, RELEASE_IDENTIFIER):
+                    self.frames.append((data[i + 1], identifier == PRESS_IDENTIFIER, now))
+                # Anything else is a heartbeat
+                i += 2
+            data = data[i:]
+
+
+class FifoSource:
+    """Input events written down a FIFO the client opens as its device."""
+    def __init__(self, tmp: str):
+        self.path = os.path.join(tmp, "event")
+        os.mkfifo(self.path)
+        # Opening read/write never blocks
+        self.fd = os.open(self.path, os.O_RDWR)
+        # Key events as the client sees them: code, press and timestamp
+        self.events = []
+
+    def write_chord(self, codes: list, value: int) -> None:
+        now = time.time()
+        os.write(self.fd, chord_events(codes, value, now))
+        self.events.extend((code, value == 1, now) for code in codes)
+
+    def close(self) -> None:
+        os.close(self.fd)
+        os.unlink(self.path)
+
+
+class UinputSource:
+    """A virtual keyboard, so events come through evdev like real ones."""
+    def __init__(self):
+        self.fd = os.open(UINPUT_DEVICE, os.O_WRONLY)
+        try:
+            fcntl.ioctl(self.fd, UI_SET_EVBIT, EV_KEY)
+            for code in CHORD_KEYS:
+                fcntl.ioctl(self.fd, UI_SET_KEYBIT, code)
+            fcntl.ioctl(self.fd, UI_DEV_SETUP,
+                        struct.pack(UINPUT_SETUP_FORMAT, BUS_VIRTUAL, 0, 0, 0, b"bench keyboard", 0))
+            fcntl.ioctl(self.fd, UI_DEV_CREATE)
+            sysname = fcntl.ioctl(self.fd, UI_GET_SYSNAME_64, bytes(64)).rstrip(b'\0').decode()
+            self.path = self._event_node(sysname)
+            # The kernel stamps each event once for all its readers, so
+            # reading alongside the client shows the stamps it gets
+            self.reader = os.open(self.path, os.O_RDONLY)
+        except OSError:
+            os.close(self.fd)
+            raise
+        self.events = []
+        threading.Thread(target=self._read, daemon=True).start()
+
+    def _read(self) -> None:
+        size = struct.calcsize(INPUT_EVENT_FORMAT)
+        while True:
+            try:
+                data = os.read(self.reader, size * 64)
+            except OSError:
+                return
+            if not data:
+                return
+            for i in range(0, len(data) - size + 1, size):
+                sec, usec, event_type, code, value = struct.unpack_from(INPUT_EVENT_FORMAT, data, i)
+                if event_type == EV_KEY and value in (0, 1):
+                    self.events.append((code, value == 1, sec + usec / 1000000))
+
+    @staticmethod
+    def _event_node(sysname: str) -> str:
+        """Find the evdev node of the new device, udev may take a moment."""
+        sysfs = f"/sys/devices/virtual/input/{sysname}"
+        deadline = time.monotonic() + 2
+        while time.monotonic() < deadline:
+            for name in os.listdir(sysfs):
+                path = f"/dev/input/{name}"
+                if name.startswith("event") and os.access(path, os.R_OK):
+                    return path
+            time.sleep(0.01)
+        raise OSError(f"No event node for {sysname}")
+
+    def write_chord(self, codes: list, value: int) -> None:
+        os.write(self.fd, chord_events(codes, value))
+
+    def close(self) -> None:
+        fcntl.ioctl(self.fd, UI_DEV_DESTROY)
+        os.close(self.fd)
+        os.close(self.reader)
+
+
+def cpu_seconds(pid: int) -> float:
+    """User plus system time a process has used so far."""
+    with open(f"/proc/{pid}/stat") as f:
+        stat = f.read()
+    # Skip the command name, it may hold spaces
+    fields = stat[stat.rindex(')') + 2:].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+
+
+def chord_events(codes: list, value: int, now: Optional[float] = None) -> bytes:
+    """One evdev packet pressing or releasing all of codes."""
+    if now is None:
+        now = time.time()
+    return b''.join(input_event(EV_KEY, code, value, now) for code in codes) + \
+        input_event(EV_SYN, SYN_REPORT, 0, now)
+
+
+def client_command(kind: str, port: int, device: str, extra: list) -> list:
+    """Command line for one of the clients, pointed at the sink and device."""
+    if kind == "c":
+        return [os.path.join(HERE, "client"), "-h", "127.0.0.1", "-p", str(port),
+                "-d", device, "-i", "0"] + extra
+    return [sys.executable, os.path.join(HERE, "client.py"), "-H", "127.0.0.1",
+            "-p", str(port), "-d", device, "-i", "0"] + extra
+
+
+def wait_for(conn: socket.socket, frame: bytes, deadline: float) -> bool:
+    """Read from the client until frame turns up."""
+    data = b''
+    while frame not in data:
+        left = deadline - time.monotonic()
+        if left <= 0:
+            return False
+        ready, _, _ = select.select([conn], [], [], left)
+        if not ready:
+            return False
+        chunk = conn.recv(4096)
+        if not chunk:
+            return False
+        # Only the tail can hold the start of a split frame
+        data = data[-len(frame):] + chunk
+    return True
+
+
+def startup_once(args, sink: Sink, device: str) -> Optional[float]:
+    """Launch a client with a key already waiting and time its arrival."""
+    # Opening read/write never blocks, and leaves the event waiting for
+    # whenever the client gets around to reading it
+    fifo = os.open(device, os.O_RDWR)
+    start = time.monotonic()
+    os.write(fifo, input_event(EV_KEY, KEY_A, 1))
+
+    proc = subprocess.Popen(client_command(args.client, sink.port, device, args.extra),
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    deadline = start + args.timeout
+    conn = None
+    try:
+        conn = sink.accept(args.timeout)
+        if conn is None or not wait_for(conn, bytes([PRESS_IDENTIFIER, KEY_A]), deadline):
+            return None
+        return time.monotonic() - start
+    finally:
+        proc.terminate()
+        proc.wait()
+        if conn is not None:
+            conn.close()
+        os.close(fifo)
+
+
+def startup(args) -> int:
+    """Time from launching a client to its first key reaching the forwarder."""
+    sink = Sink()
+    with tempfile.TemporaryDirectory() as tmp:
+        device = os.path.join(tmp, "event")
+        os.mkfifo(device)
+
+        times = []
+        for run in range(args.runs):
+            t = startup_once(args, sink, device)
+            if t is None:
+                print(f"Run {run + 1}: no key within {args.timeout}s", file=sys.stderr)
+                return 1
+            if args.verbose:
+                print(f"Run {run + 1}: {t * 1000:.1f} ms")
+            times.append(t * 1000)
+
+    print(f"{args.client} client, time to first forwarded key over {args.runs} runs: "
+          f"min {min(times):.1f} ms, median {statistics.median(times):.1f} ms, "
+          f"max {max(times):.1f} ms")
+    return 0
+
+
+def wait_count(events: list, count: int, deadline: float) -> bool:
+    while len(events) < count:
+        if time.monotonic() >= deadline:
+            return False
+        time.sleep(0.001)
+    return True
+
+
+def wait_settled(events: list, count: int, timeout: float) -> bool:
+    """Wait for count events, or for them to stop coming for a while."""
+    deadline = time.monotonic() + timeout
+    quiet = 0.5
+    seen = len(events)
+    last = time.monotonic()
+    while len(events) < count:
+        now = time.monotonic()
+        if len(events) != seen:
+            seen = len(events)
+            last = now
+        if now >= deadline or now - last >= quiet:
+            return False
+        time.sleep(0.001)
+    return True
+
+
+def match_events(sent: list, received: list) -> tuple:
+    """Pair each forwarded frame with the event it came from.
+
+    Nothing is reordered on the way, so the frames are the events with some
+    missing. A frame belongs to the next event with its code and direction,
+    the code standing in for a sequence number as chords move through the
+    keys. Returns the latencies and the number of events never forwarded.
+    """
+    latencies = []
+    dropped = 0
+    i = 0
+    for code, press, arrived in received:
+        j = i
+        while j < len(sent) and sent[j][:2] != (code, press):
+            j += 1
+        if j == len(sent):
+            continue
+        dropped += j - i
+        latencies.append(arrived - sent[j][2])
+        i = j + 1
+    return latencies, dropped + len(sent) - i
+
+
+def percentile(values: list, p: float) -> float:
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+def throughput_once(args, kind: str, tmp: str) -> Optional[dict]:
+    """Feed one client events at the given rate and chord size."""
+    source = None
+    if args.source in ("uinput", "auto"):
+        try:
+            source = UinputSource()
+        except OSError as e:
+            if args.source == "uinput":
+                print(f"Can't create uinput device: {e}", file=sys.stderr)
+                return None
+    if source is None:
+        source = FifoSource(tmp)
+
+    sink = Sink()
+    codes = CHORD_KEYS[:args.chord]
+    proc = subprocess.Popen(client_command(kind, sink.port, source.path, args.extra),
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    conn = None
+    try:
+        conn = sink.accept(args.timeout)
+        if conn is None:
+            print(f"{kind} client didn't connect", file=sys.stderr)
+            return None
+        receiver = Receiver(conn)
+
+        # One press and release to get everything warm before measuring
+        source.write_chord(codes, 1)
+        source.write_chord(codes, 0)
+        deadline = time.monotonic() + args.timeout
+        if not wait_count(receiver.frames, 2 * len(codes), deadline) or \
+                not wait_count(source.events, 2 * len(codes), deadline):
+            print(f"{kind} client forwarded nothing", file=sys.stderr)
+            return None
+        base = len(receiver.frames)
+        sent_base = len(source.events)
+        cpu = cpu_seconds(proc.pid)
+
+        # Each packet is the whole chord going down or coming up, the next
+        # chord along once it is up again
+        interval = len(codes) / args.rate
+        count = 0
+        value = 1
+        chord = 0
+        start = time.time()
+        due = time.monotonic()
+        end = due + args.duration
+        while due < end or value == 0:
+            now = time.monotonic()
+            if now < due:
+                time.sleep(due - now)
+            codes = [CHORD_KEYS[(chord * args.chord + i) % len(CHORD_KEYS)] for i in range(args.chord)]
+            source.write_chord(codes, value)
+            count += len(codes)
+            if value == 0:
+                chord += 1
+            value ^= 1
+            due += interval
+
+        wait_count(source.events, sent_base + count, time.monotonic() + args.timeout)
+        complete = wait_settled(receiver.frames, base + count, args.timeout)
+        cpu = cpu_seconds(proc.pid) - cpu
+        received = receiver.frames[base:]
+        if not received:
+            print(f"{kind} client forwarded nothing", file=sys.stderr)
+            return None
+        latencies, dropped = match_events(source.events[sent_base:], received)
+        return {
+            "source": type(source).__name__[:-len("Source")].lower(),
+            "sent": count,
+            "received": len(received),
+            "dropped": dropped,
+            "complete": complete,
+            "rate": len(received) / (received[-1][2] - start),
+            "cpu": cpu / len(received),
+            "latencies": sorted(latencies),
+        }
+    finally:
+        proc.terminate()
+        proc.wait()
+        if conn is not None:
+            conn.close()
+        source.close()
+
+
+def throughput(args) -> int:
+    """Events per second, CPU per event and latency of forwarding key events."""
+    if not 1 <= args.chord <= MAX_CHORD:
+        print(f"Chords can be 1 to {MAX_CHORD} keys", file=sys.stderr)
+        return 1
+
+    clients = ["python", "c"] if args.client == "both" else [args.client]
+    status = 0
+    with tempfile.TemporaryDirectory() as tmp:
+        for kind in clients:
+            r = throughput_once(args, kind, tmp)
+            if r is None:
+                status = 1
+                continue
+            us = [l * 1000000 for l in r["latencies"]]
+            print(f"{kind} client via {r['source']}, {args.rate} events/s offered, "
+                  f"chords of {args.chord}:")
+            print(f"  forwarded {r['received']} of {r['sent']} events, {r['rate']:.0f} events/s")
+            print(f"  CPU {r['cpu'] * 1000000:.1f} us per event")
+            if us:
+                print(f"  latency from event timestamp min {us[0]:.0f} us, "
+                      f"median {statistics.median(us):.0f} us, "
+                      f"p99 {percentile(us, 0.99):.0f} us, max {us[-1]:.0f} us")
+            if r["dropped"]:
+                print(f"  dropped {r['dropped']} events")
+            if not r["complete"]:
+                status = 1
+    return status
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark the input clients")
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    p = commands.add_parser("startup", help=startup.__doc__)
+    p.add_argument(
+        "-c", "--client",
+        choices=["python", "c"],
+        default="python",
+        help="Which client to run (default: python)"
+    )
+    p.add_argument(
+        "-n", "--runs",
+        type=int,
+        default=10,
+        help="Number of launches to time (default: 10)"
+    )
+    p.add_argument(
+        "-t", "--timeout",
+        type=float,
+        default=10,
+        help="Give up on a launch after this many seconds (default: 10)"
+    )
+    p.add_argument(
+        "-v", "--verbose",
+        action="store_true",
+        help="Print every run"
+    )
+    p.add_argument(
+        "extra",
+        nargs=argparse.REMAINDER,
+        help="Further arguments for the client, such as --wad"
+    )
+    p.set_defaults(func=startup)
+
+    p = commands.add_parser("throughput", help=throughput.__doc__)
+    p.add_argument(
+        "-c", "--client",
+        choices=["python", "c", "both"],
+        default="both",
+        help="Which client to run (default: both)"
+    )
+    p.add_argument(
+        "-r", "--rate",
+        type=int,
+        default=1000,
+        help="Key events per second to offer (default: 1000)"
+    )
+    p.add_argument(
+        "-k", "--chord",
+        type=int,
+        default=1,
+        help="Keys pressed and released together in each event packet (default: 1)"
+    )
+    p.add_argument(
+        "-d", "--duration",
+        type=float,
+        default=5,
+        help="Seconds to keep sending for (default: 5)"
+    )
+    p.add_argument(
+        "-s", "--source",
+        choices=["auto", "uinput", "fifo"],
+        default="auto",
+        help="Where events come from, auto uses uinput when it can (default: auto)"
+    )
+    p.add_argument(
+        "-t", "--timeout",
+        type=float,
+        default=10,
+        help="Give up on a client after this many seconds without progress (default: 10)"
+    )
+    p.add_argument(
+        "extra",
+        nargs=argparse.REMAINDER,
+        help="Further arguments for the client"
+    )
+    p.set_defaults(func=throughput)
+
+    args = parser.parse_args()
+    if args.extra[:1] == ["--"]:
+        args.extra = args.extra[1:]
+    sys.exit(args.func(args))
+
+
+if __name__ == "__main__":
+    main()
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,15 +11,27 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <linux/input.h>
 #include <netdb.h>
+#include <stddef.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+
+#include "protocol.h"
+#include "fwd.h"
+#include "trace.h"
 
 #define SERVER_HOST "127.0.0.1"          // Replace with the server's IP address
 #define SERVER_PORT "65432"              // The port the server is listening on
 #define EVENT_DEVICE "/dev/input/event0" // The input event file to listen to
-
-#define PRESS_IDENTIFIER 254
-#define RELEASE_IDENTIFIER 255
+#define HEARTBEAT_MS 1000                // Idle time before sending a heartbeat
+#define TIMEOUT_MS 3000                  // Give up on a silent forwarder after this long
+#define BAUD_RATE 115200                 // Serial speed of a locally attached board
 
 void usage(const char *prog_name) {
     printf("Usage: %s [options]\n", prog_name);
@@ -25,6 +39,18 @@ void usage(const char *prog_name) {
     printf("  -h, --host <hostname>    Specify the hostname (default %s)\n", SERVER_HOST);
     printf("  -p, --port <port>        Specify the port (default %s)\n", SERVER_PORT);
     printf("  -d, --device <device>    Specify the device name (default %s)\n", EVENT_DEVICE);
+    printf("  -u, --unix               Connect over the forwarder's local unix socket\n");
+    printf("  -s, --shm                Send input through shared memory (implies --unix)\n");
+    printf("  -I, --id <name>          Identify as this client, so reconnecting replaces\n");
+    printf("                           the old connection straight away\n");
+    printf("      --secret <string>    Token proving the identity, if the forwarder has one\n");
+    printf("  -i, --heartbeat <ms>     Heartbeat interval when idle (default %d, 0 to disable)\n", HEARTBEAT_MS);
+    printf("  -t, --timeout <ms>       Exit if the forwarder is silent this long (default %d,\n", TIMEOUT_MS);
+    printf("                           0 to disable)\n");
+    printf("  -l, --local <serial>     Drive a board attached to this serial port directly,\n");
+    printf("                           without a forwarder\n");
+    printf("  -b, --baud <rate>        Baud rate of the local board (default %d)\n", BAUD_RATE);
+    printf("      --trace <file>       Append Chrome trace events to this file, see tracing.py\n");
     printf("  -v, --verbose            Enable verbose output\n");
     printf("\n");
 }
@@ -33,6 +59,332 @@ static char *host = SERVER_HOST;
 static char *port = SERVER_PORT;
 static char *device = EVENT_DEVICE;
 static bool verbose = false;
+static bool use_unix = false;
+static bool use_shm = false;
+static int heartbeat_ms = HEARTBEAT_MS;
+static int timeout_ms = TIMEOUT_MS;
+static const char *identity;
+static const char *secret = "";
+static const char *local_device;
+static int baud = BAUD_RATE;
+
+static int sock = -1;
+static struct fwd *board;
+static struct shm_ring *shm;
+static int doorbell_fd = -1;
+static uint32_t trace_conn;     // How the forwarder tells us apart in traces
+static uint32_t key_seq;        // Key frames sent so far
+
+// Connect to the forwarder over TCP
+static int connect_tcp(void)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *result;
+    int status;
+    if ((status = getaddrinfo(host, port, &hints, &result)) != 0) {
+        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
+        return -1;
+    }
+
+    // Create the TCP socket
+    int fd;
+    if ((fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol)) < 0) {
+        perror("Socket creation error");
+        freeaddrinfo(result);
+        return -1;
+    }
+
+    // Connect to the server, use the first result
+    if (connect(fd, result->ai_addr, result->ai_addrlen) == -1) {
+        perror("Connection Failed");
+        close(fd);
+        freeaddrinfo(result);
+        return -1;
+    }
+
+    freeaddrinfo(result);
+    return fd;
+}
+
+// Connect to a forwarder on this host through its abstract unix socket
+static int connect_unix(void)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Socket creation error");
+        return -1;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    int len = snprintf(address.sun_path + 1, sizeof(address.sun_path) - 1, UNIX_SOCKET_NAME, port);
+    socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+
+    if (connect(fd, (struct sockaddr *)&address, addrlen) == -1) {
+        perror("Connection Failed");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Create a shared memory ring and doorbell and hand them to the forwarder
+static int attach_shm(int fd)
+{
+    int ring_fd = memfd_create("doom-input-ring", MFD_CLOEXEC);
+    if (ring_fd < 0 || ftruncate(ring_fd, sizeof(struct shm_ring)) < 0) {
+        perror("Failed to create shared memory ring");
+        return -1;
+    }
+
+    shm = mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    if (shm == MAP_FAILED) {
+        perror("Failed to map shared memory ring");
+        close(ring_fd);
+        return -1;
+    }
+
+    doorbell_fd = eventfd(0, EFD_CLOEXEC);
+    if (doorbell_fd < 0) {
+        perror("Failed to create doorbell");
+        close(ring_fd);
+        return -1;
+    }
+
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    char frame[2] = { (char)SHM_IDENTIFIER, 0 };
+    struct iovec iov = { .iov_base = frame, .iov_len = sizeof(frame) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    int fds[2] = { ring_fd, doorbell_fd };
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &msg, 0) != sizeof(frame)) {
+        perror("Failed to pass shared memory ring");
+        close(ring_fd);
+        return -1;
+    }
+
+    // The forwarder holds its own reference now
+    close(ring_fd);
+    return 0;
+}
+
+// Tell the forwarder who we are, before anything else
+static int send_hello(int fd)
+{
+    unsigned char buffer[2 + 255];
+    const char *name = identity ? identity : "";
+    char trace_id[10] = "";
+    size_t identity_len = strlen(name);
+
+    // An empty token keeps the trace id in its place
+    if (trace_enabled) {
+        snprintf(trace_id, sizeof(trace_id), "%08x", trace_conn);
+    }
+    size_t trace_len = strlen(trace_id);
+    bool has_token = *secret || trace_len;
+    size_t len = identity_len + (has_token ? 1 + strlen(secret) : 0) + (trace_len ? 1 + trace_len : 0);
+
+    if (len > 255) {
+        fprintf(stderr, "Identity and secret too long\n");
+        return -1;
+    }
+
+    buffer[0] = HELLO_IDENTIFIER;
+    buffer[1] = len;
+    unsigned char *p = buffer + 2;
+    memcpy(p, name, identity_len);
+    p += identity_len;
+    if (has_token) {
+        *p++ = 0;
+        memcpy(p, secret, strlen(secret));
+        p += strlen(secret);
+    }
+    if (trace_len) {
+        *p++ = 0;
+        memcpy(p, trace_id, trace_len);
+    }
+
+    if (send(fd, buffer, 2 + len, 0) != (ssize_t)(2 + len)) {
+        perror("Failed to send hello");
+        return -1;
+    }
+    return 0;
+}
+
+// Send a frame to the forwarder, through shared memory if attached
+static int send_frame(const char *buffer, size_t len)
+{
+    if (!shm) {
+        return send(sock, buffer, len, 0) == (ssize_t)len ? 0 : -1;
+    }
+
+    uint32_t head = shm->head;
+    // Only happens if the forwarder has stopped draining, give it a moment
+    while (head - __atomic_load_n(&shm->tail, __ATOMIC_ACQUIRE) + len > SHM_RING_SIZE) {
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+        nanosleep(&ts, NULL);
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        shm->data[(head + i) % SHM_RING_SIZE] = buffer[i];
+    }
+    __atomic_store_n(&shm->head, head + len, __ATOMIC_RELEASE);
+
+    uint64_t one = 1;
+    return write(doorbell_fd, &one, sizeof(one)) == sizeof(one) ? 0 : -1;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// Read whatever the forwarder sent. Only its heartbeat lines matter here,
+// once one has been seen the forwarder is expected to keep talking.
+static int receive_data(bool *heartbeats)
+{
+    static size_t line_len;
+    static char line_start;
+    char buffer[256];
+
+    ssize_t bytes_read = recv(sock, buffer, sizeof(buffer), 0);
+    if (bytes_read <= 0) {
+        if (bytes_read == 0) {
+            printf("Server closed connection\n");
+        } else {
+            perror("Error receiving from server");
+        }
+        return -1;
+    }
+
+    for (ssize_t i = 0; i < bytes_read; i++) {
+        if (buffer[i] == '\n') {
+            if (line_len == 1 && line_start == HEARTBEAT_LINE[0]) {
+                *heartbeats = true;
+            }
+            line_len = 0;
+        } else if (line_len++ == 0) {
+            line_start = buffer[i];
+        }
+    }
+
+    return 0;
+}
+
+// Send a key transition. Codes that don't fit in a byte, such as gamepad
+// buttons, go in the three byte extended frame.
+static int send_key(bool press, int code)
+{
+    unsigned char buffer[3];
+
+    if (board) {
+        // Only full if the port is behind, give it a chance to catch up
+        if (fwd_key(board, press, code) < 0 &&
+            (fwd_flush(board) < 0 || fwd_key(board, press, code) < 0)) {
+            return -1;
+        }
+        return fwd_flush(board);
+    }
+
+    key_seq++;
+    return send_frame((const char *)buffer, fwd_encode_key(buffer, press, code));
+}
+
+// Pick the id our HELLO gives the connection in traces, so the forwarder
+// knows us by it whatever our address looks like from there
+static void trace_connection(void)
+{
+    while (!trace_conn) {
+        if (getrandom(&trace_conn, sizeof(trace_conn), 0) < 0) {
+            trace_conn = getpid() ^ time(NULL);
+        }
+    }
+}
+
+// Read what a locally attached board has to say, only of interest when
+// being verbose
+static int receive_local(void)
+{
+    char buffer[256];
+
+    ssize_t bytes_read = fwd_read(board, buffer, sizeof(buffer));
+    if (bytes_read < 0) {
+        return -1;
+    }
+    if (verbose && bytes_read) {
+        printf("Board: %.*s", (int)bytes_read, buffer);
+    }
+    return 0;
+}
+
+// Have the kernel drop everything but key events and the reports that end
+// them, so a busy mouse on the same receiver doesn't wake us. Packets with
+// nothing left in them aren't delivered at all. Failing is harmless, older
+// kernels and non-evdev devices just hand us everything as before.
+static void mask_events(int event_fd)
+{
+    unsigned char types[EV_MAX / 8 + 1] = { 0 };
+    // Type 0 is the mask of event types, not EV_SYN's codes. The kernel
+    // never filters EV_SYN codes, SYN_REPORT and SYN_DROPPED always arrive.
+    struct input_mask mask = {
+        .type = 0,
+        .codes_size = sizeof(types),
+        .codes_ptr = (uintptr_t)types,
+    };
+
+    types[EV_SYN / 8] |= 1 << (EV_SYN % 8);
+    types[EV_KEY / 8] |= 1 << (EV_KEY % 8);
+
+    if (ioctl(event_fd, EVIOCSMASK, &mask) < 0 && verbose) {
+        printf("Event mask not supported, filtering in user space\n");
+    }
+}
+
+// Press whatever is already held down. After replacing an old connection
+// the forwarder has released its keys, this puts back the ones still down.
+static int send_held_keys(int event_fd)
+{
+    unsigned char keys[KEY_MAX / 8 + 1];
+
+    // Not an evdev device, nothing to go on
+    if (ioctl(event_fd, EVIOCGKEY(sizeof(keys)), keys) < 0) {
+        return 0;
+    }
+
+    for (int code = 0; code <= KEY_MAX; code++) {
+        if (keys[code / 8] & (1 << (code % 8))) {
+            if (verbose) {
+                printf("Key Held: %d\n", code);
+            }
+            if (send_key(true, code) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
     int opt;
@@ -40,10 +392,19 @@ int main(int argc, char *argv[]) {
         {"host",    required_argument, 0, 'h'},
         {"port",    required_argument, 0, 'p'},
         {"device",  required_argument, 0, 'd'},
+        {"unix",    no_argument,       0, 'u'},
+        {"shm",     no_argument,       0, 's'},
+        {"id",      required_argument, 0, 'I'},
+        {"secret",  required_argument, 0, 'S'},
+        {"heartbeat", required_argument, 0, 'i'},
+        {"timeout", required_argument, 0, 't'},
+        {"local",   required_argument, 0, 'l'},
+        {"baud",    required_argument, 0, 'b'},
+        {"trace",   required_argument, 0, 'R'},
         {"verbose", no_argument,       0, 'v'},
         {0, 0, 0, 0} // End of array marker
     };
-    const char *short_options = "h:p:d:v";
+    const char *short_options = "h:p:d:usI:i:t:l:b:v";
     int long_index = 0;
 
     while ((opt = getopt_long(argc, argv, short_options, long_options, &long_index)) != -1) {
@@ -57,6 +418,36 @@ int main(int argc, char *argv[]) {
             case 'd':
                 device = optarg;
                 break;
+            case 'u':
+                use_unix = true;
+                break;
+            case 's':
+                use_unix = true;
+                use_shm = true;
+                break;
+            case 'I':
+                identity = optarg;
+                break;
+            case 'S':
+                secret = optarg;
+                break;
+            case 'i':
+                heartbeat_ms = atoi(optarg);
+                break;
+            case 't':
+                timeout_ms = atoi(optarg);
+                break;
+            case 'l':
+                local_device = optarg;
+                break;
+            case 'b':
+                baud = atoi(optarg);
+                break;
+            case 'R':
+                if (trace_open(optarg, "client") < 0) {
+                    exit(1);
+                }
+                break;
             case 'v':
                 verbose = true;
                 break;
@@ -72,64 +463,135 @@ int main(int argc, char *argv[]) {
         perror("Failed to open input device");
         return 1;
     }
+    mask_events(event_fd);
 
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+    if (local_device) {
+        board = fwd_open(local_device, baud);
+        if (!board) {
+            close(event_fd);
+            return 1;
+        }
+        // Nothing in between to keep alive or time out
+        heartbeat_ms = 0;
+        timeout_ms = 0;
+    } else {
+        sock = use_unix ? connect_unix() : connect_tcp();
+        if (sock < 0) {
+            close(event_fd);
+            return 1;
+        }
+        if (trace_enabled) {
+            trace_connection();
+        }
 
-    struct addrinfo *result;
-    int status;
-    if ((status = getaddrinfo(host, port, &hints, &result)) != 0) {
-        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
-        close(event_fd);
-        return -1;
-    }
+        if ((identity || trace_enabled) && send_hello(sock) < 0) {
+            close(event_fd);
+            close(sock);
+            return 1;
+        }
 
-    // Create the TCP socket
-    int sock;
-    if ((sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol)) < 0) {
-        perror("Socket creation error");
-        close(event_fd);
-        freeaddrinfo(result);
-        return 1;
+        if (use_shm && attach_shm(sock) < 0) {
+            close(event_fd);
+            close(sock);
+            return 1;
+        }
     }
 
-    // Connect to the server, use the first result
-    if (connect(sock, result->ai_addr, result->ai_addrlen) == -1) {
-        perror("Connection Failed");
+    if (send_held_keys(event_fd) < 0) {
+        perror("Failed to send data");
         close(event_fd);
-        close(sock);
-        freeaddrinfo(result);
+        if (board) {
+            fwd_close(board);
+        } else {
+            close(sock);
+        }
         return 1;
     }
 
-    freeaddrinfo(result);
+    uint64_t last_tx = now_ms();
+    uint64_t last_rx = last_tx;
+    bool heartbeats = false;
 
     while (1) {
         struct input_event ev;
+        struct pollfd fds[2] = {
+            { .fd = event_fd, .events = POLLIN },
+            { .fd = sock, .events = POLLIN },
+        };
+
+        if (board) {
+            fds[1].fd = fwd_fd(board);
+            fds[1].events = fwd_want_write(board) ? POLLIN | POLLOUT : POLLIN;
+        }
+
+        // Wake up regularly to keep the heartbeat and timeout going
+        if (poll(fds, 2, heartbeat_ms || timeout_ms ? 100 : -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        uint64_t now = now_ms();
+
+        if (board) {
+            if (fds[1].revents & POLLOUT && fwd_flush(board) < 0) {
+                break;
+            }
+            if (fds[1].revents & (POLLIN | POLLHUP | POLLERR) && receive_local() < 0) {
+                break;
+            }
+        } else if (fds[1].revents) {
+            if (receive_data(&heartbeats) < 0) {
+                break;
+            }
+            last_rx = now;
+        }
+
+        // Only a forwarder that sends heartbeats can be timed out
+        if (timeout_ms && heartbeats && now - last_rx >= (uint64_t)timeout_ms) {
+            fprintf(stderr, "Forwarder timed out\n");
+            break;
+        }
+
+        if (heartbeat_ms && now - last_tx >= (uint64_t)heartbeat_ms) {
+            char buffer[2] = { (char)HEARTBEAT_IDENTIFIER, 0 };
+            if (send_frame(buffer, sizeof(buffer)) < 0) {
+                perror("Failed to send heartbeat");
+                break;
+            }
+            last_tx = now;
+        }
+
+        if (!fds[0].revents) {
+            continue;
+        }
 
         // Read a single input event
-        if (read(event_fd, &ev, sizeof(struct input_event)) < 0) {
+        ssize_t bytes_read = read(event_fd, &ev, sizeof(struct input_event));
+        uint64_t read_at = trace_enabled ? trace_now() : 0;
+        if (bytes_read < 0) {
             perror("Error reading input event");
             break;
         }
+        if (bytes_read == 0) {
+            printf("Input device closed\n");
+            break;
+        }
 
         // Check if the event is a key event
         if (ev.type == EV_KEY) {
-            char buffer[2];
             int code = ev.code;
 
             if (ev.value == 1) { // Key press
                 if (verbose) {
                     printf("Key Down: %d\n", code);
                 }
-                buffer[0] = PRESS_IDENTIFIER;
             } else if (ev.value == 0) { // Key release
                 if (verbose) {
                     printf("Key Up: %d\n", code);
                 }
-                buffer[0] = RELEASE_IDENTIFIER;
             } else if (ev.value == 2) { // Key auto repeat
                 // Ignore
                 continue;
@@ -138,22 +600,36 @@ int main(int argc, char *argv[]) {
                 continue;
             }
 
-            // Validate key code fits in a byte
-            if (code > 255) {
+            // Not a key the protocol knows about
+            if (code >= KEY_CODES) {
                 printf("Key code %d too large, skipping\n", code);
                 continue;
             }
-            buffer[1] = (char)code;
 
-            if (send(sock, buffer, sizeof(buffer), 0) != sizeof(buffer)) {
+            uint64_t id = trace_key_id(trace_conn, key_seq);
+            if (send_key(ev.value == 1, code) < 0) {
                 perror("Failed to send data");
                 break;
             }
+            last_tx = now;
+
+            // The read starts when the kernel stamped the event
+            if (trace_enabled && !board) {
+                char args[32];
+                snprintf(args, sizeof(args), "\"code\":%d,\"press\":%d", code, ev.value);
+                trace_event("key read", "key", ev.input_event_sec * 1000000000ULL + ev.input_event_usec * 1000ULL,
+                            read_at, id, TRACE_FLOW_OUT, args);
+                trace_event("client send", "key", read_at, trace_now(), id, TRACE_FLOW_IN | TRACE_FLOW_OUT, NULL);
+            }
         }
     }
 
     // Cleanup
     close(event_fd);
-    close(sock);
+    if (board) {
+        fwd_close(board);
+    } else {
+        close(sock);
+    }
     return 0;
 }
@@ -5,14 +5,20 @@ Converts key press/release events from a Linux input device to network messages.
 """
 
 import argparse
+import ctypes
+import fcntl
 import socket
 import struct
 import sys
 import os
+import random
 import select
+import threading
+import time
+import tracing
 import wad
-import audio
 
+from collections import deque
 from typing import Optional
 
 # Constants
@@ -23,9 +29,47 @@ DEFAULT_WAD = "DOOM.WAD"
 
 PRESS_IDENTIFIER = 254
 RELEASE_IDENTIFIER = 255
+# Codes above 255, such as gamepad buttons, use a three byte frame with the
+# code big endian after the identifier
+PRESS_EXTENDED_IDENTIFIER = 248
+RELEASE_EXTENDED_IDENTIFIER = 247
+# Key codes are always below KEY_CNT
+KEY_CODES = 0x300
+# Sent when idle so the forwarder knows we're still here
+HEARTBEAT_IDENTIFIER = 250
+# Optional first frame, names the client so a reconnect replaces the old one
+HELLO_IDENTIFIER = 249
+# Line the forwarder sends when the board has been quiet
+HEARTBEAT_LINE = b'H'
+
+# Default heartbeat interval and forwarder timeout, in milliseconds
+HEARTBEAT_MS = 1000
+TIMEOUT_MS = 3000
+
+# How many sounds to hold while the audio pool starts, with --early-sounds queue
+EARLY_SOUNDS_MAX = 8
+
+# Native input path, built by make. fastinput_forward() returns one of these.
+FASTINPUT_LIBRARY = os.path.join(os.path.dirname(os.path.abspath(__file__)), "fastinput.so")
+FASTINPUT_TIMEOUT = 0
+FASTINPUT_SERVER = 1
+FASTINPUT_CLOSED = 2
+
+# Abstract unix socket the forwarder listens on for clients on the same host
+UNIX_SOCKET_NAME = "doom-forwarder-{}"
 
 # Linux input event constants
+EV_SYN = 0x00
 EV_KEY = 0x01
+EV_MAX = 0x1f
+KEY_MAX = 0x2ff
+# EVIOCGKEY(len): _IOC(_IOC_READ, 'E', 0x18, len)
+KEY_BITMAP_SIZE = KEY_MAX // 8 + 1
+EVIOCGKEY = (2 << 30) | (KEY_BITMAP_SIZE << 16) | (ord('E') << 8) | 0x18
+# EVIOCSMASK: _IOW('E', 0x93, struct input_mask), the struct being the
+# event type, the size of the code bitmap and a pointer to it
+INPUT_MASK_FORMAT = 'IIQ'
+EVIOCSMASK = (1 << 30) | (struct.calcsize(INPUT_MASK_FORMAT) << 16) | (ord('E') << 8) | 0x93
 
 # Input event structure format (from linux/input.h)
 # struct input_event {
@@ -39,15 +83,100 @@ INPUT_EVENT_FORMAT = 'QQHHi'
 INPUT_EVENT_SIZE = struct.calcsize(INPUT_EVENT_FORMAT)
 
 
+class BackgroundAudio:
+    """
+    Parses the WAD and starts the audio pool in a thread, so forwarding input
+    doesn't wait for GStreamer. Sounds that arrive before the pool is ready
+    are queued, up to EARLY_SOUNDS_MAX, or dropped, depending on policy.
+    """
+    def __init__(self, wad_file: str, policy: str = "drop", verbose: bool = False,
+                 trace: Optional[tracing.Trace] = None):
+        self.wad_file = wad_file
+        self.policy = policy
+        self.verbose = verbose
+        self.trace = trace
+        self.lock = threading.Lock()
+        self.pool = None
+        self.early = deque()
+        self.dropped = 0
+        self.thread = threading.Thread(target=self._load, daemon=True)
+        self.thread.start()
+
+    def _load(self) -> None:
+        start = time.monotonic()
+        try:
+            # GStreamer is slow to import, keep it off the startup path too
+            import audio
+            w = wad.Wad(self.wad_file)
+            pool = audio.AudioPlayerPool(w.lumps, verbose=self.verbose, trace=self.trace)
+        except Exception as e:
+            print(f"Sound disabled: {e}", file=sys.stderr)
+            with self.lock:
+                self.early.clear()
+            return
+
+        with self.lock:
+            self.pool = pool
+            early = list(self.early)
+            self.early.clear()
+        for id, trace_args in early:
+            pool.play_sound(id, trace_args)
+
+        if self.verbose:
+            print(f"Audio ready after {time.monotonic() - start:.3f}s, "
+                  f"{len(early)} early sounds played, {self.dropped} dropped")
+
+    def play_sound(self, id: int, trace_args: Optional[dict] = None) -> None:
+        with self.lock:
+            pool = self.pool
+            if pool is None:
+                if self.policy == "queue" and len(self.early) < EARLY_SOUNDS_MAX:
+                    self.early.append((id, trace_args))
+                else:
+                    self.dropped += 1
+                return
+        pool.play_sound(id, trace_args)
+
+
 class InputEventClient:
-    def __init__(self, audio: audio.AudioPlayerPool, host: str, port: int, device: str, verbose: bool = False):
+    def __init__(self, audio: Optional[BackgroundAudio], host: str, port: int, device: str, verbose: bool = False,
+                 use_unix: bool = False, heartbeat_ms: int = HEARTBEAT_MS, timeout_ms: int = TIMEOUT_MS,
+                 identity: Optional[str] = None, secret: str = "",
+                 trace: Optional[tracing.Trace] = None):
         self.audio = audio
         self.host = host
         self.port = port
         self.device = device
         self.verbose = verbose
+        self.use_unix = use_unix
+        self.identity = identity
+        self.secret = secret
+        self.heartbeat = heartbeat_ms / 1000
+        self.timeout = timeout_ms / 1000
+        # Only a forwarder that has sent a heartbeat can be timed out
+        self.server_heartbeats = False
+        self.last_tx = 0.0
+        self.last_rx = 0.0
+        self.partial_line = b''
+        self.rx_offset = 0
+        self.trace = trace
+        # How the forwarder tells us apart in traces, and key frames sent so far
+        self.trace_conn = 0
+        self.key_seq = 0
         self.event_fd: Optional[int] = None
         self.sock: Optional[socket.socket] = None
+        self.native = None
+
+    def load_native(self) -> None:
+        """Use the C input path if it has been built."""
+        try:
+            self.native = ctypes.CDLL(FASTINPUT_LIBRARY, use_errno=True)
+        except OSError:
+            if self.verbose:
+                print("No fastinput.so, forwarding input in Python")
+            return
+        self.native.fastinput_forward.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int,
+                                                  ctypes.POINTER(ctypes.c_int)]
 
     def open_device(self) -> None:
         """Open the input device file."""
@@ -57,16 +186,70 @@ class InputEventClient:
             print(f"Failed to open input device '{self.device}': {e}", file=sys.stderr)
             sys.exit(1)
 
+    def mask_events(self) -> None:
+        """Have the kernel drop everything but key events and their reports."""
+        types = ctypes.create_string_buffer(EV_MAX // 8 + 1)
+        types[0] = 1 << EV_SYN | 1 << EV_KEY
+
+        # Type 0 is the mask of event types, not EV_SYN's codes. The kernel
+        # never filters EV_SYN codes, SYN_REPORT and SYN_DROPPED always arrive.
+        try:
+            mask = struct.pack(INPUT_MASK_FORMAT, 0, len(types), ctypes.addressof(types))
+            fcntl.ioctl(self.event_fd, EVIOCSMASK, mask)
+        except OSError:
+            # Older kernels and non-evdev devices hand us everything
+            if self.verbose:
+                print("Event mask not supported, filtering in user space")
+
     def connect_to_server(self) -> None:
         """Connect to the remote server."""
         try:
-            self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-            self.sock.connect((self.host, self.port))
+            if self.use_unix:
+                # Leading NUL selects the abstract namespace
+                self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                self.sock.connect("\0" + UNIX_SOCKET_NAME.format(self.port))
+            else:
+                self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                self.sock.connect((self.host, self.port))
         except socket.error as e:
             print(f"Connection failed: {e}", file=sys.stderr)
             self.cleanup()
             sys.exit(1)
 
+        # Our HELLO gives the forwarder this id for us in traces, whatever
+        # our address looks like from there
+        if self.trace:
+            self.trace_conn = random.randrange(1, 1 << 32)
+
+    def send_hello(self) -> bool:
+        """Tell the server who we are, so a reconnect replaces the old connection."""
+        body = (self.identity or "").encode()
+        # An empty token keeps the trace id in its place
+        if self.secret or self.trace:
+            body += b'\0' + self.secret.encode()
+        if self.trace:
+            body += b'\0' + f"{self.trace_conn:08x}".encode()
+        if len(body) > 255:
+            print("Identity and secret too long", file=sys.stderr)
+            return False
+        return self.send_frame(bytes([HELLO_IDENTIFIER, len(body)]) + body)
+
+    def send_held_keys(self) -> bool:
+        """Press whatever is already held down, the server released any old state."""
+        try:
+            keys = fcntl.ioctl(self.event_fd, EVIOCGKEY, bytes(KEY_BITMAP_SIZE))
+        except OSError:
+            # Not an evdev device, nothing to go on
+            return True
+
+        for code in range(KEY_MAX + 1):
+            if keys[code // 8] & (1 << (code % 8)):
+                if self.verbose:
+                    print(f"Key Held: {code}")
+                if not self.send_key_event(True, code):
+                    return False
+        return True
+
     def read_input_event(self) -> Optional[tuple]:
         """Read a single input event from the device."""
         try:
@@ -76,25 +259,48 @@ class InputEventClient:
 
             # Unpack the input event structure
             tv_sec, tv_usec, event_type, code, value = struct.unpack(INPUT_EVENT_FORMAT, data)
-            return event_type, code, value
+            return event_type, code, value, tv_sec * 1000000000 + tv_usec * 1000
         except OSError as e:
             print(f"Error reading input event: {e}", file=sys.stderr)
             return None
 
     def send_key_event(self, is_press: bool, code: int) -> bool:
         """Send a key event to the server."""
-        if code > 255:
+        if code >= KEY_CODES:
             print(f"Key code {code} too large, skipping")
             return True
 
-        identifier = PRESS_IDENTIFIER if is_press else RELEASE_IDENTIFIER
-        buffer = bytes([identifier, code])
+        self.key_seq += 1
+        if code > 255:
+            identifier = PRESS_EXTENDED_IDENTIFIER if is_press else RELEASE_EXTENDED_IDENTIFIER
+            return self.send_frame(bytes([identifier]) + code.to_bytes(2, 'big'))
 
+        identifier = PRESS_IDENTIFIER if is_press else RELEASE_IDENTIFIER
+        return self.send_frame(bytes([identifier, code]))
+
+    def send_traced_key(self, is_press: bool, code: int, stamp: int) -> bool:
+        """Send a key event read from the device, tracing both steps if asked."""
+        if not self.trace:
+            return self.send_key_event(is_press, code)
+
+        read_at = tracing.now()
+        id = tracing.key_id(self.trace_conn, self.key_seq)
+        ok = self.send_key_event(is_press, code)
+        # The read starts when the kernel stamped the event
+        self.trace.event("key read", "key", stamp, read_at, id, tracing.FLOW_OUT,
+                         {"code": code, "press": int(is_press)})
+        self.trace.event("client send", "key", read_at, tracing.now(), id,
+                         tracing.FLOW_IN | tracing.FLOW_OUT)
+        return ok
+
+    def send_frame(self, buffer: bytes) -> bool:
+        """Send a frame to the server."""
         try:
             sent = self.sock.send(buffer)
             if sent != len(buffer):
                 print("Failed to send complete data", file=sys.stderr)
                 return False
+            self.last_tx = time.monotonic()
             return True
         except socket.error as e:
             print(f"Failed to send data: {e}", file=sys.stderr)
@@ -111,16 +317,33 @@ class InputEventClient:
             if self.verbose:
                 print(f"Received from server: {data.decode('utf-8')}")
 
-            # split data into lines
-            lines = data.split(b'\n')
+            self.last_rx = time.monotonic()
+
+            # split data into lines, keeping any incomplete one for next time
+            offset = self.rx_offset - len(self.partial_line)
+            self.rx_offset += len(data)
+            lines = (self.partial_line + data).split(b'\n')
+            self.partial_line = lines.pop()
             for line in lines:
-                if line.startswith(b'P'):
+                if line == HEARTBEAT_LINE:
+                    self.server_heartbeats = True
+                elif line.startswith(b'P'):
                     try:
                         n = int(line[1:])
+                        trace_args = None
+                        if self.trace:
+                            # Where the line is in what we've been sent, the
+                            # forwarder's trace says where that started
+                            trace_args = {"conn": self.trace_conn, "offset": offset, "sound": n}
+                            t = tracing.now()
+                            self.trace.event("sound line", "sound", t, t,
+                                             flow=tracing.FLOW_IN | tracing.FLOW_OUT, args=trace_args)
                         # It's the next WAD for some reason
-                        self.audio.play_sound(n+1)
+                        if self.audio:
+                            self.audio.play_sound(n+1, trace_args)
                     except:
                         pass
+                offset += len(line) + 1
 
             return True
         except socket.error as e:
@@ -130,65 +353,116 @@ class InputEventClient:
     def run(self) -> None:
         """Main event loop."""
         self.open_device()
+        self.mask_events()
         self.connect_to_server()
 
-        print(f"Connected to {self.host}:{self.port}, reading from {self.device}")
+        where = "local forwarder" if self.use_unix else f"{self.host}:{self.port}"
+        print(f"Connected to {where}, reading from {self.device}")
         if self.verbose:
             print("Verbose mode enabled")
 
+        self.last_tx = self.last_rx = time.monotonic()
+
+        if (self.identity or self.trace) and not self.send_hello():
+            self.cleanup()
+            return
+        if not self.send_held_keys():
+            self.cleanup()
+            return
+
         try:
             while True:
-                # Use select to poll both input device and network socket
-                ready_fds, _, error_fds = select.select(
-                    [self.event_fd, self.sock.fileno()],  # Read list
-                    [],                                    # Write list
-                    [self.sock.fileno()],                 # Error list
-                    0.1                                   # Timeout (100ms)
-                )
-
-                # Check for socket errors
-                if error_fds:
-                    print("Socket error detected")
+                if self.native:
+                    server_ready = self.forward_native()
+                else:
+                    server_ready = self.forward_events()
+                if server_ready is None:
                     break
 
-                # Handle input events
-                if self.event_fd in ready_fds:
-                    event_data = self.read_input_event()
-                    if event_data is None:
-                        break
-
-                    event_type, code, value = event_data
-
-                    # Check if the event is a key event
-                    if event_type == EV_KEY:
-                        if value == 1:  # Key press
-                            if self.verbose:
-                                print(f"Key Down: {code}")
-                            if not self.send_key_event(True, code):
-                                break
-                        elif value == 0:  # Key release
-                            if self.verbose:
-                                print(f"Key Up: {code}")
-                            if not self.send_key_event(False, code):
-                                break
-                        elif value == 2:  # Key auto repeat
-                            # Ignore auto-repeat events
-                            continue
-                        else:
-                            if self.verbose:
-                                print(f"Unknown key event value: {value}")
-                            continue
+                if not self.check_heartbeat(server_ready):
+                    break
 
                 # Handle server data
-                if self.sock.fileno() in ready_fds:
-                    if not self.handle_server_data():
-                        break
+                if server_ready and not self.handle_server_data():
+                    break
 
         except KeyboardInterrupt:
             print("\nInterrupted by user")
         finally:
             self.cleanup()
 
+    def forward_events(self) -> Optional[bool]:
+        """Forward input events for up to 100ms, returning whether the server has data."""
+        # Use select to poll both input device and network socket
+        ready_fds, _, error_fds = select.select(
+            [self.event_fd, self.sock.fileno()],  # Read list
+            [],                                    # Write list
+            [self.sock.fileno()],                 # Error list
+            0.1                                   # Timeout (100ms)
+        )
+
+        # Check for socket errors
+        if error_fds:
+            print("Socket error detected")
+            return None
+
+        # Handle input events
+        if self.event_fd in ready_fds:
+            event_data = self.read_input_event()
+            if event_data is None:
+                return None
+
+            event_type, code, value, stamp = event_data
+
+            # Check if the event is a key event
+            if event_type == EV_KEY:
+                if value == 1:  # Key press
+                    if self.verbose:
+                        print(f"Key Down: {code}")
+                    if not self.send_traced_key(True, code, stamp):
+                        return None
+                elif value == 0:  # Key release
+                    if self.verbose:
+                        print(f"Key Up: {code}")
+                    if not self.send_traced_key(False, code, stamp):
+                        return None
+                elif value == 2:  # Key auto repeat
+                    # Ignore auto-repeat events
+                    pass
+                else:
+                    if self.verbose:
+                        print(f"Unknown key event value: {value}")
+
+        return self.sock.fileno() in ready_fds
+
+    def forward_native(self) -> Optional[bool]:
+        """Same as forward_events, but in C and for as many events as come."""
+        sent = ctypes.c_int()
+        ret = self.native.fastinput_forward(self.event_fd, self.sock.fileno(), 100, ctypes.byref(sent))
+        if sent.value:
+            self.last_tx = time.monotonic()
+        if ret < 0:
+            print(f"Error forwarding input: {os.strerror(ctypes.get_errno())}", file=sys.stderr)
+            return None
+        if ret == FASTINPUT_CLOSED:
+            print("Input device closed")
+            return None
+        return ret == FASTINPUT_SERVER
+
+    def check_heartbeat(self, server_ready: bool) -> bool:
+        """Send a heartbeat when idle, and give up on a silent server."""
+        now = time.monotonic()
+
+        if (self.timeout and self.server_heartbeats and not server_ready and
+                now - self.last_rx >= self.timeout):
+            print("Server timed out", file=sys.stderr)
+            return False
+
+        if self.heartbeat and now - self.last_tx >= self.heartbeat:
+            return self.send_frame(bytes([HEARTBEAT_IDENTIFIER, 0]))
+
+        return True
+
     def cleanup(self) -> None:
         """Clean up resources."""
         if self.event_fd is not None:
@@ -226,11 +500,52 @@ def main():
         default=EVENT_DEVICE,
         help=f"Specify the device name (default: {EVENT_DEVICE})"
     )
+    parser.add_argument(
+        "-u", "--unix",
+        action="store_true",
+        help="Connect over the local forwarder's unix socket"
+    )
+    parser.add_argument(
+        "-I", "--id",
+        help="Identify as this client, so reconnecting replaces the old connection straight away"
+    )
+    parser.add_argument(
+        "--secret",
+        default="",
+        help="Token proving the identity, if the server has one"
+    )
+    parser.add_argument(
+        "-i", "--heartbeat",
+        type=int,
+        default=HEARTBEAT_MS,
+        help=f"Heartbeat interval in ms when idle, 0 to disable (default: {HEARTBEAT_MS})"
+    )
+    parser.add_argument(
+        "-t", "--timeout",
+        type=int,
+        default=TIMEOUT_MS,
+        help=f"Exit if the server is silent this many ms, 0 to disable (default: {TIMEOUT_MS})"
+    )
     parser.add_argument(
         "-w", "--wad",
         default=DEFAULT_WAD,
         help=f"Specify the DOOM WAD file (default: {DEFAULT_WAD})"
     )
+    parser.add_argument(
+        "--early-sounds",
+        choices=["drop", "queue"],
+        default="drop",
+        help="What to do with sounds that arrive while the WAD is still loading (default: drop)"
+    )
+    parser.add_argument(
+        "--python-input",
+        action="store_true",
+        help="Forward input in Python even if fastinput.so is built (implied by --verbose and --trace)"
+    )
+    parser.add_argument(
+        "--trace",
+        help="Append Chrome trace events to this file, see tracing.py"
+    )
     parser.add_argument(
         "-v", "--verbose",
         action="store_true",
@@ -239,9 +554,6 @@ def main():
 
     args = parser.parse_args()
 
-    w = wad.Wad(args.wad)
-    s = audio.AudioPlayerPool(w.lumps)
-
     # Check if device exists
     if not os.path.exists(args.device):
         print(f"Error: Device '{args.device}' does not exist", file=sys.stderr)
@@ -253,7 +565,21 @@ def main():
         print("Try running with sudo or adding your user to the input group", file=sys.stderr)
         sys.exit(1)
 
-    client = InputEventClient(s, args.host, args.port, args.device, args.verbose)
+    trace = None
+    if args.trace:
+        try:
+            trace = tracing.Trace(args.trace, "client.py")
+        except OSError as e:
+            print(f"Failed to open trace '{args.trace}': {e}", file=sys.stderr)
+            sys.exit(1)
+
+    # Connect and forward straight away, sound catches up when it's loaded
+    s = BackgroundAudio(args.wad, args.early_sounds, args.verbose, trace)
+    client = InputEventClient(s, args.host, args.port, args.device, args.verbose, args.unix,
+                             args.heartbeat, args.timeout, args.id, args.secret, trace)
+    # Printing and tracing every key are only done by the Python path
+    if not args.python_input and not args.verbose and not trace:
+        client.load_native()
     client.run()
 
 
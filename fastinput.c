@@ -0,0 +1,111 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/input.h>
+
+#include "protocol.h"
+#include "fwd.h"
+
+// Input hot path for client.py, loaded with ctypes. ctypes lets go of the
+// GIL for the whole call, so the audio threads run while we wait here.
+
+// Return values of fastinput_forward()
+#define FASTINPUT_TIMEOUT 0     // The timeout passed, call again
+#define FASTINPUT_SERVER 1      // The server has sent something
+#define FASTINPUT_CLOSED 2      // The input device went away
+
+// Events read in one go, a chord and its report easily fit
+#define EVENT_BATCH 64
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int send_all(int sock, const unsigned char *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Forward key presses and releases from event_fd to sock until the server
+// has something for us, the device closes or timeout_ms passes. *sent is
+// the number of frames sent, so the caller knows when it last transmitted.
+// Returns -1 with errno set on error.
+int fastinput_forward(int event_fd, int sock, int timeout_ms, int *sent)
+{
+    uint64_t deadline = now_ms() + timeout_ms;
+
+    *sent = 0;
+
+    while (1) {
+        struct pollfd fds[2] = {
+            { .fd = event_fd, .events = POLLIN },
+            { .fd = sock, .events = POLLIN },
+        };
+        uint64_t now = now_ms();
+
+        if (now >= deadline) {
+            return FASTINPUT_TIMEOUT;
+        }
+
+        if (poll(fds, 2, deadline - now) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        if (fds[0].revents) {
+            struct input_event ev[EVENT_BATCH];
+            unsigned char out[EVENT_BATCH * 3];
+            size_t out_len = 0;
+
+            ssize_t bytes_read = read(event_fd, ev, sizeof(ev));
+            if (bytes_read < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            if (bytes_read == 0) {
+                return FASTINPUT_CLOSED;
+            }
+
+            for (size_t i = 0; i < bytes_read / sizeof(ev[0]); i++) {
+                // Auto repeat and codes the protocol can't carry are dropped
+                if (ev[i].type != EV_KEY || (ev[i].value != 0 && ev[i].value != 1) ||
+                    ev[i].code >= KEY_CODES) {
+                    continue;
+                }
+                out_len += fwd_encode_key(out + out_len, ev[i].value == 1, ev[i].code);
+                (*sent)++;
+            }
+
+            if (out_len && send_all(sock, out, out_len) < 0) {
+                return -1;
+            }
+        }
+
+        if (fds[1].revents) {
+            return FASTINPUT_SERVER;
+        }
+    }
+}
@@ -1,7 +1,10 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
@@ -9,181 +12,3666 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <termios.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <linux/serial.h>
+
+#include "protocol.h"
+#include "fwd.h"
+#include "trace.h"
+
+#define PORT 65432
+#define DEVICE "/dev/ttyUSB0"
+#define BAUD_RATE 115200
+
+#define RX_BUFFER_SIZE 64
+#define TX_BUFFER_SIZE 256
+// Most the serial port is read in one go, straight into the output ring
+#define SERIAL_READ_SIZE 4096
+
+#define MAX_BOARDS 16
+#define MAX_WORKERS 64
+#define MAX_SESSIONS 129
+#define MAX_POLL_FDS (7 + 2 * MAX_SESSIONS)
+#define MAX_PLAYERS 4
+// Connections held open while every player slot is taken, so a returning
+// client can take its slot back without waiting in the listen backlog
+#define MAX_PENDING 4
+// Default spectators per board, whatever the session table has room for
+#define MAX_SPECTATORS (MAX_SESSIONS - MAX_PLAYERS - MAX_PENDING - 1)
+
+// Frames parsed from each player, waiting for their turn on the serial link
+#define FRAME_QUEUE_SIZE 256
+
+// Doom runs at 35 tics per second
+#define TIC_NS (1000000000ULL / 35)
+// Default frames per player per tic when several players share a board
+#define TIC_CAP 8
+
+// Default per client token bucket, in frames per second and burst size
+#define RATE_LIMIT 100
+#define RATE_BURST 20
+// Largest rate accepted, far beyond any player. A queue holds no more
+// than its size, so neither a burst nor a tic cap can usefully exceed it.
+#define RATE_LIMIT_MAX 10000
+// Share of the serial link budget only releases may use, in percent
+#define LINK_RESERVE 25
+
+// Presses remembered per session to keep compacted taps visible
+#define RECENT_PRESSES 16
+
+// Chords resolved by the keymap, each one a key pressed while another is down
+#define MAX_CHORDS 64
+#define KEYMAP_NONE 0xffff
+
+// Default heartbeat interval and dead peer timeout, in milliseconds
+#define HEARTBEAT_MS 1000
+#define TIMEOUT_MS 3000
+
+// Default serial errors per second that make a board fall back to a slower
+// baud, and seconds it stays there before trying the next faster one
+#define LINK_ERRORS 10
+#define PROBE_INTERVAL 60
+// Each failed step up doubles the wait, to at most this
+#define PROBE_INTERVAL_MAX 3600
+
+// Key frames remembered for matching against the board's acks
+#define KEY_LOG_SIZE 256
+// A key frame still unacknowledged this long after it was written, while
+// the board acknowledges later ones, never arrived
+#define KEY_LOSS_NS 250000000ULL
+// Unacknowledged frames and no ack at all for this long, either they or
+// their acks were lost
+#define KEY_ACK_TIMEOUT_NS 500000000ULL
+
+// Seconds before reopening a failed board or restarting a dead worker.
+// Each failure in a row doubles it, to at most RESTART_DELAY_MAX, and
+// staying up for RESTART_RESET seconds starts it over.
+#define RESTART_DELAY_MAX 60
+#define RESTART_RESET 60
+
+// Serial traffic priorities, lower lanes always go first
+enum {
+    LANE_INPUT,         // Key transitions from players
+    LANE_CONTROL,       // Link and session management
+    LANE_BULK,          // Anything large or latency insensitive
+    NR_LANES
+};
+
+#define LANE_QUEUE_SIZE 64
+
+#define PPM_HEADER "P6\n320 200\n255\n"
+// Framebuffer records kept for WebSocket clients, a few key frames' worth
+#define FB_RING_SIZE (4 * FB_RECORD_MAX)
+
+// Largest WebSocket handshake taken, browsers send well under this
+#define WS_REQUEST_MAX 2048
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+// Origins allowed to open WebSocket connections besides the same origin
+#define MAX_WS_ORIGINS 16
+
+// Serial output is kept in a ring so every connection reads the same copy
+#define RING_SIZE (64 * 1024)
+
+// Per board counters, exposed through the stats endpoint
+struct board_stats {
+    unsigned long connections;
+    unsigned long spectators;
+    unsigned long spectators_dropped;
+    unsigned long local_connections;
+    unsigned long websocket_connections;
+    unsigned long websockets_dropped;
+    unsigned long websockets_refused;
+    unsigned long shm_attached;
+    unsigned long client_rx_bytes;
+    unsigned long client_tx_bytes;
+    unsigned long client_tx_dropped;
+    unsigned long serial_rx_bytes;
+    unsigned long serial_tx_bytes;
+    unsigned long frames_forwarded;
+    unsigned long frames_deferred;
+    unsigned long frames_rate_dropped;
+    unsigned long frames_link_deferred;
+    unsigned long frames_compacted;
+    unsigned long frames_unmapped;
+    unsigned long frames_rejected;
+    unsigned long releases_held;
+    unsigned long keys_released;
+    unsigned long heartbeats_sent;
+    unsigned long sessions_timed_out;
+    unsigned long takeovers;
+    unsigned long tic_markers;
+    unsigned long tic_markers_missed;
+    unsigned long tic_phase_error_us;   // Of the last marker, before correcting
+    unsigned long frames_early;
+    unsigned long frames_on_time;
+    unsigned long frames_missed;
+    unsigned long frames_tics_late;     // Summed over the missed frames
+    unsigned long fb_frames;
+    unsigned long fb_record_bytes;
+    unsigned long fb_errors;
+    unsigned long fb_frames_dropped;
+    unsigned long uart_errors;          // Framing, parity and overrun errors the tty counted
+    unsigned long crc_errors;
+    unsigned long baud;                 // What the link runs at now
+    unsigned long baud_changes;
+    unsigned long baud_changes_failed;
+    unsigned long connections_routed;   // Accepted by another worker and passed on
+    unsigned long key_acks;
+    unsigned long key_frames_acked;
+    unsigned long key_ack_latency_us_sum;   // Written to the tty to applied by the board
+    unsigned long key_ack_latency_us_max;
+    unsigned long key_ack_tics_sum;     // Board tics between writing and applying, with tic sync
+    unsigned long key_frames_lost;
+    unsigned long key_resyncs;
+    unsigned long pool_free[2];         // Players, spectators
+    struct {
+        unsigned long frames;
+        unsigned long latency_us_sum;   // Queued to written to the tty
+        unsigned long latency_us_max;
+    } lanes[NR_LANES];
+};
+
+struct frame {
+    unsigned char data[3];
+    uint8_t len;
+    uint64_t queued;
+    uint64_t trace_id;      // Key frames from clients, when tracing
+};
+
+// Forwarder generated frames waiting for the serial link
+struct lane {
+    struct frame queue[LANE_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t tail;
+};
+
+enum {
+    WS_NONE,            // A native client
+    WS_HANDSHAKE,       // Waiting for the browser's upgrade request
+    WS_OPEN,
+};
+
+// WebSocket framing for a browser client, both ways
+struct websocket {
+    int state;
+    char request[WS_REQUEST_MAX];
+    size_t request_len;
+    unsigned char in_header[14];    // Header of the frame being read
+    int in_header_len;
+    bool in_payload;        // Past the header
+    unsigned char in_mask[4];
+    uint64_t in_left;       // Payload bytes left in the frame being read
+    uint64_t in_pos;
+    bool in_discard;        // Control frame payload, not input
+    unsigned char out_header[11];   // Header of the message being sent
+    int out_header_len;
+    int out_header_sent;
+    uint32_t out_left;      // Payload still to send after the header
+    bool out_fb;            // Payload comes from the framebuffer ring
+    bool out_palette;       // Payload is palette below
+    uint64_t fb_cursor;     // Next byte of the board's framebuffer ring to send
+    bool palette_pending;   // Send palette before anything from the ring
+    unsigned char palette[2 + 256 * 3];     // Palette record as of the upgrade
+};
+
+// A connection to a board, either the player or a read-only spectator
+struct session {
+    int fd;
+    bool spectator;
+    bool local;             // Connected over the unix socket
+    bool pending;           // Waiting for a free player slot
+    bool evicted;           // Taken over by a newer connection, about to close
+    int slot;               // Player number on the board, -1 if none
+    uint32_t serial;        // Order of arrival
+    char peer[64];          // For messages
+    char host[32];          // Peer address without the port, or local uid
+    unsigned char hello[256];   // HELLO body, identity, token and trace id
+    int hello_len;
+    int hello_left;
+    uint64_t cursor;        // Next byte of the board's output ring to send
+    struct shm_ring *shm;   // Optional input ring shared with a local client
+    int doorbell_fd;
+    bool heartbeats;        // Client sends heartbeats, so can be timed out
+    uint64_t last_rx;
+    uint32_t trace_conn;    // Identifies the connection in traces
+    uint64_t trace_cursor;  // Where its output started in the ring
+    uint32_t trace_seq;     // Key frames received so far
+    unsigned char partial[3];
+    int partial_len;
+    struct frame queue[FRAME_QUEUE_SIZE];
+    uint32_t queue_head;
+    uint32_t queue_tail;
+    uint32_t deferred_mark;     // Frames before this were already counted as deferred
+    uint32_t link_blocked_mark; // Frame index + 1 last counted as waiting for the link
+    int sent_this_tic;
+    double tokens;              // Rate limit bucket, in frames
+    uint64_t tokens_updated;
+    struct {
+        uint16_t code;
+        uint64_t tic;
+    } recent[RECENT_PRESSES];   // Tic each recently sent press went out in
+    int next_recent;
+    uint8_t held[KEY_CODES / 8];    // Keys the board has down for this player
+    uint8_t down[KEY_CODES / 8];    // Keys the client has down, before the keymap
+    uint16_t mapped[KEY_CODES];     // What each key the client has down became, + 1
+    uint8_t mapped_count[KEY_CODES];    // Client keys holding each mapped key down
+    struct websocket ws;
+};
+
+// Framebuffer records pulled out of a board's serial output
+struct framebuffer {
+    bool seen;              // seq is valid
+    uint8_t seq;
+    bool synced;            // pixels hold a whole frame deltas can apply to
+    unsigned char *pixels;
+    unsigned char palette[256 * 3];
+    char *path;             // Where decoded frames go, NULL for nowhere
+    int out_fd;
+    char *ppm;              // The frame being written out
+    size_t ppm_len;
+    size_t ppm_sent;
+};
+
+// A key frame written to the board, kept until the board acknowledges it
+struct key_record {
+    uint64_t written;
+    uint32_t board_tic;     // The board's tic when it was written, 0 without tic sync
+    int8_t slot;
+    uint16_t code;
+    uint64_t trace_id;
+};
+
+// Fixed size objects carved out of a single allocation made at startup
+struct pool {
+    char *slab;
+    void *free_list;        // Threaded through the free objects
+    size_t size;
+    unsigned long *nr_free;  // In the board's stats, where every worker can see it
+};
+
+// A serial attached board and the TCP ports serving it
+struct board {
+    int index;
+    const char *device;
+    int port;
+    int spectator_port;
+    int websocket_port;
+    int baud;               // What the link runs at now
+    int top_baud;           // Configured baud, the link only ever falls back from it
+    // From here to handoff is cleared each time the board is closed
+    int serial_fd;
+    int server_fd;
+    int spectator_fd;
+    int unix_fd;
+    int websocket_fd;
+    pthread_t thread;
+    struct session *sessions[MAX_SESSIONS];
+    int nr_sessions;
+    int nr_players;
+    int nr_pending;
+    uint32_t nr_accepted;
+    int last_slot;          // Slot the board currently applies key frames to
+    uint64_t tic;
+    uint64_t tic_phase;     // Tics start at multiples of TIC_NS plus this
+    bool tic_synced;        // tic_phase follows the board's markers
+    uint64_t last_marker;
+    uint32_t marker_tic;    // Tic number of the last marker
+    struct fwd_parser parser;   // Splits serial input into text, markers and records
+    bool sound_line;        // Serial input is inside a sound line, when tracing
+    uint64_t sound_offset;  // Where it starts in the ring
+    uint32_t sound;
+    int next_session;       // Round robin starting point
+    double link_tokens;     // Serial bandwidth budget, in bytes
+    uint64_t link_updated;
+    bool link_blocked;
+    bool backlog;           // Frames were left over at the last tic boundary
+    struct lane lanes[NR_LANES];    // LANE_INPUT only has releases for departed players
+    uint8_t presence;       // Player slots last announced to the board
+    uint64_t ring_head;     // Total bytes ever written to the ring
+    uint64_t ring_written;  // Furthest the ring has been written, reads land past ring_head
+    uint64_t last_output;   // When anything was last added to the ring
+    bool icount;            // The tty counts UART errors
+    unsigned long uart_errors;  // Total at the last link check
+    // Framebuffer records are the only output the board checksums, so only
+    // boards sending them can show errors a tty without UART counters hides
+    unsigned long link_errors;  // CRC failures since the last link check
+    uint64_t link_checked;
+    int baud_pending;       // BAUD_RATES index asked for, -1 if none
+    bool baud_sent;         // The request is on the wire, nothing else goes out
+    uint64_t baud_deadline; // Give up on the request once it has been on the wire this long
+    uint64_t probe_at;      // When to try a faster baud again
+    uint64_t probe_until;   // Errors before this mean the last step up failed
+    int probe_interval;     // Seconds, doubled by each failed step up
+    bool acks_seen;         // The board acknowledges key frames, and has since the last timeout
+    uint32_t keys_written;  // Key frames written since acks were asked for
+    uint32_t keys_acked;    // How many of those the board has accounted for
+    uint16_t ack_offset;    // How far the board's count is behind, from lost frames
+    uint64_t last_ack;
+    struct key_record key_log[KEY_LOG_SIZE];
+    struct framebuffer fb;
+    int nr_websockets;      // Open ones, the board streams frames while there are any
+    char *fb_ring;          // Length prefixed records for WebSocket clients
+    uint64_t fb_ring_head;
+    char ring[RING_SIZE];
+    struct pool player_pool;
+    struct pool spectator_pool;
+    int handoff[2];         // Connections other workers accepted for it, read end first
+    struct board_stats *stats;
+};
+
+// Kinds of connection, as passed between workers
+enum {
+    ACCEPT_PLAYER,
+    ACCEPT_SPECTATOR,
+    ACCEPT_WEBSOCKET,
+};
+
+// Shared by every worker process, set up before they are forked
+struct shared {
+    unsigned long heap_allocations;
+    struct {
+        int owner;          // Worker serving the board
+        bool ready;         // Its owner has the board open and takes handoffs
+    } routes[MAX_BOARDS];
+    struct board_stats stats[MAX_BOARDS];
+};
+
+static struct board boards[MAX_BOARDS];
+static int nr_boards;
+static bool verbose;
+static int players = 1;
+static int tic_cap = TIC_CAP;
+static int rate_limit = RATE_LIMIT;
+static int rate_burst = RATE_BURST;
+static bool compact;
+static int heartbeat_ms = HEARTBEAT_MS;
+static int timeout_ms = TIMEOUT_MS;
+static const char *secret;
+static const char *ws_origins[MAX_WS_ORIGINS];
+static int nr_ws_origins;
+
+// Evdev code to the key the board sees, a flat table so translating is a
+// single load. Only used when a keymap is given. Frames with codes past
+// the table are dropped on arrival, and keymaps can't name them.
+static bool use_keymap;
+static uint16_t keymap[KEY_CODES];
+static struct {
+    uint16_t modifier;
+    uint16_t key;
+    uint16_t value;
+} chords[MAX_CHORDS];
+static int nr_chords;
+
+static const char *fb_output;
+static int max_spectators = MAX_SPECTATORS;
+static bool tic_sync;
+static int tic_lead_us;
+static int link_errors = LINK_ERRORS;
+static int probe_interval = PROBE_INTERVAL;
+static bool key_acks;
+
+static const int baud_rates[] = BAUD_RATES;
+#define NR_BAUD_RATES (int)(sizeof(baud_rates) / sizeof(baud_rates[0]))
+
+// With several workers each board is served by one of them, the rest
+// accept its connections and pass them on
+static int workers = 1;
+static int worker;
+static struct shared *shared;
+
+// Set once the boards are up, allocations after that are counted
+static bool running;
+
+static inline void stat_add(unsigned long *counter, unsigned long n)
+{
+    // Counters have a single writer (the owning board thread); readers
+    // only need a consistent snapshot of each individual value.
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long stat_read(const unsigned long *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Every allocation the forwarder makes goes through here, so the stats can
+// show that nothing is allocated once it is up and forwarding
+static void *heap_alloc(size_t size)
+{
+    if (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&shared->heap_allocations, 1, __ATOMIC_RELAXED);
+    }
+    return calloc(1, size);
+}
+
+static void pool_put(struct pool *p, void *object)
+{
+    *(void **)object = p->free_list;
+    p->free_list = object;
+    stat_add(p->nr_free, 1);
+}
+
+// Objects come back zeroed, NULL once the pool is empty
+static void *pool_get(struct pool *p)
+{
+    void *object = p->free_list;
+
+    if (object) {
+        p->free_list = *(void **)object;
+        stat_add(p->nr_free, -1UL);
+        memset(object, 0, p->size);
+    }
+    return object;
+}
+
+static int pool_init(struct pool *p, size_t size, int nr, unsigned long *nr_free)
+{
+    p->nr_free = nr_free;
+    p->size = size;
+    // A board without a spectator port has an empty pool and needs no slab
+    if (nr == 0) {
+        return 0;
+    }
+    p->slab = heap_alloc(size * nr);
+    if (!p->slab) {
+        return -1;
+    }
+    for (int i = nr - 1; i >= 0; i--) {
+        pool_put(p, p->slab + i * size);
+    }
+    return 0;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Board tics, aligned with the board's own once its markers are tracked
+static inline uint64_t board_tic(const struct board *b, uint64_t t)
+{
+    return (t - b->tic_phase) / TIC_NS;
+}
+
+static inline uint64_t board_tic_start(const struct board *b, uint64_t tic)
+{
+    return tic * TIC_NS + b->tic_phase;
+}
+
+static inline bool frame_is_key(const struct frame *f)
+{
+    return f->data[0] == PRESS_IDENTIFIER || f->data[0] == RELEASE_IDENTIFIER ||
+           f->data[0] == PRESS_EXTENDED_IDENTIFIER || f->data[0] == RELEASE_EXTENDED_IDENTIFIER;
+}
+
+static inline bool frame_is_press(const struct frame *f)
+{
+    return f->data[0] == PRESS_IDENTIFIER || f->data[0] == PRESS_EXTENDED_IDENTIFIER;
+}
+
+static inline bool frame_is_release(const struct frame *f)
+{
+    return f->data[0] == RELEASE_IDENTIFIER || f->data[0] == RELEASE_EXTENDED_IDENTIFIER;
+}
+
+static inline int frame_key(const struct frame *f)
+{
+    return f->len == 3 ? f->data[1] << 8 | f->data[2] : f->data[1];
+}
+
+static void frame_set_key(struct frame *f, bool press, int code)
+{
+    f->len = fwd_encode_key(f->data, press, code);
+}
+
+// Queue a forwarder generated frame behind any player input
+static struct frame *board_queue_frame(struct board *b, int lane, unsigned char identifier, unsigned char arg)
+{
+    struct lane *l = &b->lanes[lane];
+
+    if (l->head - l->tail == LANE_QUEUE_SIZE) {
+        fprintf(stderr, "%s: Lane %d full, dropping frame %x %x\n", b->device, lane, identifier, arg);
+        return NULL;
+    }
+
+    struct frame *f = &l->queue[l->head++ % LANE_QUEUE_SIZE];
+    f->data[0] = identifier;
+    f->data[1] = arg;
+    f->len = 2;
+    f->queued = now_ns();
+    f->trace_id = 0;
+    return f;
+}
+
+// Release every key the board still has down for a player that's gone,
+// or is about to change slots. The releases go to s->slot, so this has to
+// come before it changes.
+static void board_release_keys(struct board *b, struct session *s)
+{
+    bool switched = false;
+
+    for (int code = 0; code < KEY_CODES; code++) {
+        if (!(s->held[code / 8] & (1 << (code % 8)))) {
+            continue;
+        }
+        if (players > 1 && !switched) {
+            board_queue_frame(b, LANE_INPUT, PLAYER_IDENTIFIER, s->slot);
+            switched = true;
+        }
+        struct frame *f = board_queue_frame(b, LANE_INPUT, RELEASE_IDENTIFIER, 0);
+        if (f) {
+            frame_set_key(f, false, code);
+        }
+        stat_add(&b->stats->keys_released, 1);
+    }
+    memset(s->held, 0, sizeof(s->held));
+}
+
+static void board_close_session(struct board *b, int i)
+{
+    struct session *s = b->sessions[i];
+
+    close(s->fd);
+    if (s->shm) {
+        munmap(s->shm, sizeof(*s->shm));
+        close(s->doorbell_fd);
+    }
+    // Frames were only streamed for the browsers
+    if (s->ws.state == WS_OPEN && --b->nr_websockets == 0 && !fb_output) {
+        board_queue_frame(b, LANE_CONTROL, FRAMEBUFFER_IDENTIFIER, 0);
+    }
+    if (s->spectator) {
+        stat_add(&b->stats->spectators, -1UL);
+    } else if (s->pending) {
+        b->nr_pending--;
+    } else if (s->evicted) {
+        // Its player already belongs to the connection that replaced it
+        printf("%s: Replaced connection closed.\n", b->device);
+    } else {
+        board_release_keys(b, s);
+        b->nr_players--;
+        printf("%s: Connection closed. Ready for next connection.\n", b->device);
+    }
+    pool_put(s->spectator ? &b->spectator_pool : &b->player_pool, s);
+
+    b->sessions[i] = b->sessions[--b->nr_sessions];
+}
+
+// Lowest player number not taken by a connected player
+static int board_free_slot(struct board *b)
+{
+    for (int slot = 0; ; slot++) {
+        int i;
+        for (i = 0; i < b->nr_sessions; i++) {
+            if (b->sessions[i]->slot == slot) {
+                break;
+            }
+        }
+        if (i == b->nr_sessions) {
+            return slot;
+        }
+    }
+}
+
+// Give a connection a player slot
+static void board_seat(struct board *b, struct session *s)
+{
+    s->slot = board_free_slot(b);
+    b->nr_players++;
+    stat_add(&b->stats->connections, 1);
+    if (s->local) {
+        stat_add(&b->stats->local_connections, 1);
+    }
+    if (players > 1) {
+        printf("%s: Player %d connected from %s. Starting bidirectional forwarding...\n",
+               b->device, s->slot + 1, s->peer);
+    } else {
+        printf("%s: Connection accepted from %s. Starting bidirectional forwarding...\n",
+               b->device, s->peer);
+    }
+}
+
+// Seat whoever has waited longest once a slot frees up
+static void board_seat_pending(struct board *b)
+{
+    while (b->nr_pending && b->nr_players < players) {
+        struct session *next = NULL;
+        for (int i = 0; i < b->nr_sessions; i++) {
+            struct session *s = b->sessions[i];
+            if (s->pending && (!next || (int32_t)(s->serial - next->serial) < 0)) {
+                next = s;
+            }
+        }
+        next->pending = false;
+        b->nr_pending--;
+        board_seat(b, next);
+    }
+}
+
+// Start serving a connection, accepted here or by another worker
+// Lets tracing.py tie the sounds a client traces to the board's
+static void session_trace_connect(struct board *b, struct session *s)
+{
+    if (trace_enabled) {
+        char args[96];
+        uint64_t t = trace_now();
+        snprintf(args, sizeof(args), "\"conn\":%u,\"board\":%d,\"cursor\":%llu",
+                 s->trace_conn, b->index, (unsigned long long)s->trace_cursor);
+        trace_event("connect", "session", t, t, 0, 0, args);
+    }
+}
+
+static void board_add_session(struct board *b, int new_socket, bool spectator, bool websocket)
+{
+    struct sockaddr_storage address;
+    socklen_t addrlen = sizeof(address);
+    char peer[64] = "local client";
+
+    if (getpeername(new_socket, (struct sockaddr *)&address, &addrlen) < 0) {
+        perror("getpeername");
+        close(new_socket);
+        return;
+    }
+
+    bool local = address.ss_family == AF_UNIX;
+    char host[32];
+    uint32_t conn;
+    if (local) {
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        if (getsockopt(new_socket, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+            cred.uid = -1;
+            cred.pid = 0;
+        }
+        snprintf(host, sizeof(host), "uid %d", (int)cred.uid);
+        conn = TRACE_UNIX_CONN + cred.pid;
+    } else {
+        struct sockaddr_in *in = (struct sockaddr_in *)&address;
+        snprintf(host, sizeof(host), "%s", inet_ntoa(in->sin_addr));
+        snprintf(peer, sizeof(peer), "%s:%d", host, ntohs(in->sin_port));
+        conn = ntohs(in->sin_port);
+    }
+
+    struct session *s = pool_get(spectator ? &b->spectator_pool : &b->player_pool);
+    if (!s) {
+        fprintf(stderr, "%s: Too many connections, rejecting %s\n", b->device, peer);
+        close(new_socket);
+        return;
+    }
+    s->fd = new_socket;
+    s->spectator = spectator;
+    s->local = local;
+    s->pending = !spectator && b->nr_players == players;
+    s->slot = -1;
+    s->serial = b->nr_accepted++;
+    strcpy(s->peer, peer);
+    strcpy(s->host, host);
+    s->tokens = rate_burst;
+    s->tokens_updated = now_ns();
+    s->last_rx = s->tokens_updated;
+    s->doorbell_fd = -1;
+    s->ws.state = websocket ? WS_HANDSHAKE : WS_NONE;
+    // Only output produced from now on is of interest
+    s->cursor = b->ring_head;
+    s->trace_conn = conn;
+    s->trace_cursor = s->cursor;
+    s->trace_seq = 0;
+    b->sessions[b->nr_sessions++] = s;
+    session_trace_connect(b, s);
+
+    if (websocket) {
+        printf("%s: WebSocket connection from %s\n", b->device, peer);
+    }
+    if (spectator) {
+        stat_add(&b->stats->spectators, 1);
+        printf("%s: Spectator connected from %s\n", b->device, peer);
+    } else if (s->pending) {
+        b->nr_pending++;
+        printf("%s: Connection from %s waiting for a free slot\n", b->device, peer);
+    } else {
+        board_seat(b, s);
+    }
+}
+
+static void board_accept(struct board *b, int server_fd, bool spectator, bool websocket)
+{
+    int new_socket = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (new_socket < 0) {
+        perror("Accept failed");
+        return; // Try to accept next connection instead of exiting
+    }
+
+    board_add_session(b, new_socket, spectator, websocket);
+}
+
+// Pass a connection to the worker serving its board
+static void board_handoff(struct board *b, int fd, unsigned char kind)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = &kind, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    // Its owner is behind, the client can try again like after a full backlog
+    if (sendmsg(b->handoff[1], &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        fprintf(stderr, "%s: Can't pass connection to worker %d: %s\n",
+                b->device, shared->routes[b->index].owner, strerror(errno));
+    }
+}
+
+// Take a connection another worker accepted for one of our boards
+static void board_receive_handoff(struct board *b)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    unsigned char kind;
+    struct iovec iov = { .iov_base = &kind, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    if (recvmsg(b->handoff[0], &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) <= 0) {
+        return;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    stat_add(&b->stats->connections_routed, 1);
+    board_add_session(b, fd, kind == ACCEPT_SPECTATOR, kind == ACCEPT_WEBSOCKET);
+}
+
+static void fb_ring_write(struct board *b, const void *data, size_t len)
+{
+    size_t offset = b->fb_ring_head % FB_RING_SIZE;
+    size_t first = FB_RING_SIZE - offset < len ? FB_RING_SIZE - offset : len;
+    memcpy(b->fb_ring + offset, data, first);
+    memcpy(b->fb_ring, (const char *)data + first, len - first);
+    b->fb_ring_head += len;
+}
+
+static void fb_ring_read(const struct board *b, uint64_t pos, void *data, size_t len)
+{
+    size_t offset = pos % FB_RING_SIZE;
+    size_t first = FB_RING_SIZE - offset < len ? FB_RING_SIZE - offset : len;
+    memcpy(data, b->fb_ring + offset, first);
+    memcpy((char *)data + first, b->fb_ring, len - first);
+}
+
+// Start a binary message of type followed by len bytes of payload
+static void ws_start_message(struct websocket *ws, unsigned char type, uint32_t len)
+{
+    unsigned char *h = ws->out_header;
+    uint64_t size = len + 1;
+    int n = 0;
+
+    h[n++] = 0x82;      // Final fragment of a binary message
+    if (size < 126) {
+        h[n++] = size;
+    } else if (size < 65536) {
+        h[n++] = 126;
+        h[n++] = size >> 8;
+        h[n++] = size;
+    } else {
+        h[n++] = 127;
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            h[n++] = size >> shift;
+        }
+    }
+    h[n++] = type;
+
+    ws->out_header_len = n;
+    ws->out_header_sent = 0;
+    ws->out_left = len;
+}
+
+// Send a browser as much as its socket takes without blocking. Board
+// output and framebuffer records each go out as messages of their own,
+// straight from the rings they are kept in.
+static int board_flush_ws(struct board *b, struct session *s)
+{
+    struct websocket *ws = &s->ws;
+
+    // Output from before the upgrade is of no use to it
+    if (ws->state != WS_OPEN) {
+        s->cursor = b->ring_head;
+        return 0;
+    }
+
+    while (1) {
+        if (ws->out_header_sent == ws->out_header_len && !ws->out_left) {
+            ws->out_palette = false;
+            if (ws->palette_pending) {
+                ws->palette_pending = false;
+                ws->out_fb = false;
+                ws->out_palette = true;
+                ws_start_message(ws, WS_FRAMEBUFFER, sizeof(ws->palette));
+            } else if (ws->fb_cursor != b->fb_ring_head) {
+                uint32_t len;
+                fb_ring_read(b, ws->fb_cursor, &len, sizeof(len));
+                ws->fb_cursor += sizeof(len);
+                ws->out_fb = true;
+                ws_start_message(ws, WS_FRAMEBUFFER, len);
+            } else if (s->cursor != b->ring_head) {
+                uint64_t pending = b->ring_head - s->cursor;
+                ws->out_fb = false;
+                ws_start_message(ws, WS_TEXT, pending < 65535 ? pending : 65535);
+            } else {
+                return 0;
+            }
+        }
+
+        char *ring = ws->out_fb ? b->fb_ring : b->ring;
+        size_t size = ws->out_fb ? FB_RING_SIZE : RING_SIZE;
+        size_t offset = (ws->out_fb ? ws->fb_cursor : s->cursor) % size;
+        size_t first = size - offset < ws->out_left ? size - offset : ws->out_left;
+        struct iovec iov[3] = {
+            { .iov_base = ws->out_header + ws->out_header_sent,
+              .iov_len = ws->out_header_len - ws->out_header_sent },
+            { .iov_base = ring + offset, .iov_len = first },
+            { .iov_base = ring, .iov_len = ws->out_left - first },
+        };
+        if (ws->out_palette) {
+            iov[1].iov_base = ws->palette + sizeof(ws->palette) - ws->out_left;
+            iov[1].iov_len = ws->out_left;
+            iov[2].iov_len = 0;
+        }
+        struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = 3,
+        };
+
+        ssize_t sent = sendmsg(s->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("Failed to send serial data to WebSocket client");
+            return -1;
+        }
+        stat_add(&b->stats->client_tx_bytes, sent);
+
+        size_t header = ws->out_header_len - ws->out_header_sent;
+        if ((size_t)sent < header) {
+            ws->out_header_sent += sent;
+            return 0;
+        }
+        ws->out_header_sent = ws->out_header_len;
+        sent -= header;
+        ws->out_left -= sent;
+        if (ws->out_fb) {
+            ws->fb_cursor += sent;
+        } else if (!ws->out_palette) {
+            s->cursor += sent;
+        }
+        if (ws->out_left) {
+            return 0;
+        }
+    }
+}
+
+// Send as much of the output ring as the session's socket will take
+// without blocking. Returns -1 if the session has gone away.
+static int board_flush_session(struct board *b, struct session *s)
+{
+    if (s->ws.state != WS_NONE) {
+        return board_flush_ws(b, s);
+    }
+
+    uint64_t pending = b->ring_head - s->cursor;
+    if (pending == 0) {
+        return 0;
+    }
+
+    size_t offset = s->cursor % RING_SIZE;
+    size_t first = RING_SIZE - offset < pending ? RING_SIZE - offset : pending;
+    struct iovec iov[2] = {
+        { .iov_base = b->ring + offset, .iov_len = first },
+        { .iov_base = b->ring, .iov_len = pending - first },
+    };
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = pending > first ? 2 : 1,
+    };
+
+    ssize_t sent = sendmsg(s->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        perror("Failed to send serial data to TCP client");
+        return -1;
+    }
+
+    s->cursor += sent;
+    stat_add(&b->stats->client_tx_bytes, sent);
+    return 0;
+}
+
+static inline uint32_t session_queue_space(const struct session *s)
+{
+    return FRAME_QUEUE_SIZE - (s->queue_head - s->queue_tail);
+}
+
+static bool session_has_output(const struct board *b, const struct session *s)
+{
+    const struct websocket *ws = &s->ws;
+
+    if (ws->state == WS_OPEN && (ws->palette_pending || ws->fb_cursor != b->fb_ring_head ||
+                                 ws->out_left || ws->out_header_sent != ws->out_header_len)) {
+        return true;
+    }
+    return s->cursor != b->ring_head;
+}
+
+// Compare a client's token against our secret
+static bool secret_matches(const char *token)
+{
+    size_t len = strlen(secret);
+    unsigned char diff = 0;
+
+    if (strlen(token) != len) {
+        return false;
+    }
+    // Take the same time however much of it matches
+    for (size_t i = 0; i < len; i++) {
+        diff |= token[i] ^ secret[i];
+    }
+    return diff == 0;
+}
+
+// A client has named itself. If an older connection holds the same
+// identity it is replaced straight away, provided the newcomer proves it
+// is the same client: with the secret when the forwarder has one,
+// otherwise by connecting from the same host. The old connection's keys
+// are released and the new client presses whatever it is really holding.
+static void board_hello(struct board *b, struct session *s)
+{
+    s->hello[s->hello_len] = 0;
+    const char *identity = (const char *)s->hello;
+    size_t identity_len = strlen(identity);
+    const char *token = identity_len < (size_t)s->hello_len ? identity + identity_len + 1 : "";
+
+    // A tracing client names its connection, the port we see may not be its
+    size_t trace_at = identity_len + 1 + strlen(token) + 1;
+    if (identity_len < (size_t)s->hello_len && trace_at < (size_t)s->hello_len) {
+        uint32_t conn = strtoul(identity + trace_at, NULL, 16);
+        if (conn) {
+            s->trace_conn = conn;
+            session_trace_connect(b, s);
+        }
+    }
+
+    if (!identity_len) {
+        return;
+    }
+
+    for (int i = 0; i < b->nr_sessions; i++) {
+        struct session *o = b->sessions[i];
+
+        if (o == s || o->spectator || o->evicted || !o->hello_len || o->hello_left ||
+            strcmp((const char *)o->hello, identity)) {
+            continue;
+        }
+
+        if (secret ? !secret_matches(token) : strcmp(s->host, o->host)) {
+            fprintf(stderr, "%s: %s claims to be %s but can't prove it, not taking over\n",
+                    b->device, s->peer, identity);
+            return;
+        }
+
+        // As if it had disconnected, before its slot goes to s
+        board_release_keys(b, o);
+        // Whatever it still had queued is stale now
+        o->queue_tail = o->queue_head;
+        o->evicted = true;
+
+        if (o->pending) {
+            o->pending = false;
+            b->nr_pending--;
+        } else {
+            if (s->pending) {
+                s->pending = false;
+                b->nr_pending--;
+            } else {
+                // Nothing it pressed may stay down in the slot it leaves
+                board_release_keys(b, s);
+                b->nr_players--;
+            }
+            s->slot = o->slot;
+            o->slot = -1;
+        }
+
+        stat_add(&b->stats->takeovers, 1);
+        printf("%s: %s (%s) took over from %s\n", b->device, identity, s->peer, o->peer);
+        return;
+    }
+}
+
+// Translate a client's key transition through the keymap. Returns the key
+// the board should see, or -1 for none. A key pressed while a chord's
+// modifier is down becomes the chord's key, and stays that until released.
+// Several keys may map to the same one, it stays down until the last of
+// them is released.
+static int session_translate(struct board *b, struct session *s, bool press, int code)
+{
+    bool down = s->down[code / 8] & (1 << (code % 8));
+    int out;
+
+    if (press) {
+        if (down) {
+            return -1;
+        }
+        s->down[code / 8] |= 1 << (code % 8);
+
+        out = keymap[code];
+        for (int i = 0; i < nr_chords; i++) {
+            int modifier = chords[i].modifier;
+            if (chords[i].key == code && s->down[modifier / 8] & (1 << (modifier % 8))) {
+                out = chords[i].value;
+                break;
+            }
+        }
+        if (out == KEYMAP_NONE) {
+            stat_add(&b->stats->frames_unmapped, 1);
+            return -1;
+        }
+
+        s->mapped[code] = out + 1;
+        return s->mapped_count[out]++ ? -1 : out;
+    }
+
+    if (!down) {
+        return -1;
+    }
+    s->down[code / 8] &= ~(1 << (code % 8));
+
+    if (!s->mapped[code]) {
+        return -1;
+    }
+    out = s->mapped[code] - 1;
+    s->mapped[code] = 0;
+    return --s->mapped_count[out] ? -1 : out;
+}
+
+// Split client input into frames and queue them for the serial link.
+// Callers never pass more than twice the queue space.
+static void session_input(struct board *b, struct session *s, const char *buffer, size_t len)
+{
+    uint64_t now = now_ns();
+
+    stat_add(&b->stats->client_rx_bytes, len);
+
+    for (size_t i = 0; i < len; i++) {
+        if (s->hello_left) {
+            s->hello[s->hello_len++] = buffer[i];
+            if (--s->hello_left == 0) {
+                board_hello(b, s);
+            }
+            continue;
+        }
+
+        s->partial[s->partial_len++] = buffer[i];
+        if (s->partial_len < fwd_frame_length(s->partial[0])) {
+            continue;
+        }
+        int frame_len = s->partial_len;
+        s->partial_len = 0;
+
+        // Only meaningful to the forwarder itself
+        if (s->partial[0] == SHM_IDENTIFIER) {
+            continue;
+        }
+        if (s->partial[0] == HEARTBEAT_IDENTIFIER) {
+            s->heartbeats = true;
+            continue;
+        }
+        if (s->partial[0] == HELLO_IDENTIFIER) {
+            s->hello_len = 0;
+            s->hello_left = s->partial[1];
+            continue;
+        }
+
+        struct frame *f = &s->queue[s->queue_head % FRAME_QUEUE_SIZE];
+        memcpy(f->data, s->partial, frame_len);
+        f->len = frame_len;
+
+        // Control frames to the board are ours to send, a client could
+        // otherwise pose as another player or move the link's baud rate
+        if (!frame_is_key(f)) {
+            stat_add(&b->stats->frames_rejected, 1);
+            continue;
+        }
+        // No such key, the board would only have to check again
+        if (frame_len == 3 && frame_key(f) >= KEY_CODES) {
+            continue;
+        }
+
+        f->queued = now;
+        f->trace_id = 0;
+        uint32_t seq = s->trace_seq++;
+        if (trace_enabled) {
+            char args[32];
+            uint64_t t = trace_now();
+            f->trace_id = trace_key_id(s->trace_conn, seq);
+            snprintf(args, sizeof(args), "\"code\":%d", frame_key(f));
+            trace_event("forwarder recv", "key", t, t, f->trace_id, TRACE_FLOW_IN | TRACE_FLOW_OUT, args);
+        }
+
+        if (use_keymap) {
+            bool press = frame_is_press(f);
+            int code = session_translate(b, s, press, frame_key(f));
+            if (code < 0) {
+                continue;
+            }
+            frame_set_key(f, press, code);
+        }
+        s->queue_head++;
+    }
+}
+
+// Tell the board which player slots are occupied whenever that changes
+static void board_announce_players(struct board *b)
+{
+    uint8_t presence = 0;
+
+    if (players == 1) {
+        return;
+    }
+
+    for (int i = 0; i < b->nr_sessions; i++) {
+        if (b->sessions[i]->slot >= 0) {
+            presence |= 1 << b->sessions[i]->slot;
+        }
+    }
+
+    if (presence != b->presence) {
+        b->presence = presence;
+        board_queue_frame(b, LANE_CONTROL, PRESENCE_IDENTIFIER, presence);
+    }
+}
+
+static void board_lane_written(struct board *b, int lane, const struct frame *f, uint64_t now)
+{
+    unsigned long latency = (now - f->queued) / 1000;
+
+    stat_add(&b->stats->lanes[lane].frames, 1);
+    stat_add(&b->stats->lanes[lane].latency_us_sum, latency);
+    if (latency > b->stats->lanes[lane].latency_us_max) {
+        stat_add(&b->stats->lanes[lane].latency_us_max, latency - b->stats->lanes[lane].latency_us_max);
+    }
+}
+
+// Remember a key frame going out, to match against the board's acks
+static void board_key_written(struct board *b, int slot, const struct frame *f, uint64_t now)
+{
+    if (!key_acks) {
+        return;
+    }
+
+    struct key_record *r = &b->key_log[b->keys_written % KEY_LOG_SIZE];
+    r->written = now;
+    r->board_tic = b->tic_synced ? b->marker_tic + (now - b->last_marker) / TIC_NS : 0;
+    r->slot = slot;
+    r->code = frame_key(f);
+    r->trace_id = f->trace_id;
+    b->keys_written++;
+}
+
+// Bytes the serial link can carry per second, at 10 bits per byte (8N1)
+static inline double link_rate(const struct board *b)
+{
+    return b->baud / 10.0;
+}
+
+// Up to two tics worth of serial traffic may be in flight at once
+static inline double link_capacity(const struct board *b)
+{
+    double capacity = 2 * link_rate(b) / 35;
+    return capacity < 64 ? 64 : capacity;
+}
+
+static void board_refill_link(struct board *b, uint64_t now)
+{
+    b->link_tokens += (now - b->link_updated) * link_rate(b) / 1e9;
+    if (b->link_tokens > link_capacity(b)) {
+        b->link_tokens = link_capacity(b);
+    }
+    b->link_updated = now;
+}
+
+// Take a token from the session's bucket, false if it is over its rate
+static bool session_take_token(struct session *s, uint64_t now)
+{
+    if (!rate_limit) {
+        return true;
+    }
+
+    s->tokens += (now - s->tokens_updated) * rate_limit / 1e9;
+    if (s->tokens > rate_burst) {
+        s->tokens = rate_burst;
+    }
+    s->tokens_updated = now;
+
+    if (s->tokens < 1) {
+        return false;
+    }
+    s->tokens--;
+    return true;
+}
+
+// True if the link can't keep up: frames are waiting for budget or have
+// already missed a tic, or the tty has more than a tic worth of output queued
+static bool board_backed_up(struct board *b)
+{
+    int outq;
+
+    if (b->link_blocked || b->backlog) {
+        return true;
+    }
+    if (ioctl(b->serial_fd, TIOCOUTQ, &outq) < 0) {
+        return false;
+    }
+    return outq > link_rate(b) / 35;
+}
+
+// Collapse each key's queued transitions to the first one, plus the last
+// one if it differs. A tap survives as a press and a release, repeated
+// taps merge into one and anything that nets out to the first transition
+// is reduced to it. Order between the remaining frames is kept.
+static void session_compact(struct board *b, struct session *s)
+{
+    int32_t first[KEY_CODES];
+    int32_t last[KEY_CODES];
+
+    memset(first, -1, sizeof(first));
+    memset(last, -1, sizeof(last));
+
+    for (uint32_t i = s->queue_tail; i != s->queue_head; i++) {
+        struct frame *f = &s->queue[i % FRAME_QUEUE_SIZE];
+        if (!frame_is_key(f)) {
+            continue;
+        }
+        if (first[frame_key(f)] < 0) {
+            first[frame_key(f)] = i - s->queue_tail;
+        }
+        last[frame_key(f)] = i - s->queue_tail;
+    }
+
+    uint32_t out = s->queue_tail;
+    for (uint32_t i = s->queue_tail; i != s->queue_head; i++) {
+        struct frame *f = &s->queue[i % FRAME_QUEUE_SIZE];
+        int32_t n = i - s->queue_tail;
+
+        if (frame_is_key(f)) {
+            int code = frame_key(f);
+            struct frame *head = &s->queue[(s->queue_tail + first[code]) % FRAME_QUEUE_SIZE];
+            bool keep = n == first[code] ||
+                        (n == last[code] && frame_is_press(f) != frame_is_press(head));
+            if (!keep) {
+                continue;
+            }
+        }
+        s->queue[out++ % FRAME_QUEUE_SIZE] = *f;
+    }
+
+    if (out != s->queue_head) {
+        stat_add(&b->stats->frames_compacted, s->queue_head - out);
+        s->queue_head = out;
+        if ((int32_t)(s->deferred_mark - out) > 0) {
+            s->deferred_mark = out;
+        }
+        s->link_blocked_mark = 0;
+    }
+}
+
+// A release whose press went out this tic would let the board miss the
+// tap entirely, so it waits for the next one
+static bool session_hold_release(struct board *b, struct session *s, const struct frame *f)
+{
+    for (int i = 0; i < RECENT_PRESSES; i++) {
+        if (s->recent[i].tic == b->tic && s->recent[i].code == frame_key(f)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Frames headed for the tty, written out in as few syscalls as possible
+struct tx_buffer {
+    unsigned char data[TX_BUFFER_SIZE];
+    size_t len;
+    uint64_t trace_ids[TX_BUFFER_SIZE / 2];   // Of the key frames in data
+    int nr_trace_ids;
+};
+
+static int board_tx_flush(struct board *b, struct tx_buffer *tx)
+{
+    uint64_t start = tx->nr_trace_ids ? trace_now() : 0;
+
+    if (tx->len && write(b->serial_fd, tx->data, tx->len) != (ssize_t)tx->len) {
+        perror("write");
+        return -1;
+    }
+    stat_add(&b->stats->serial_tx_bytes, tx->len);
+
+    if (tx->nr_trace_ids) {
+        uint64_t end = trace_now();
+        for (int i = 0; i < tx->nr_trace_ids; i++) {
+            trace_event("tty write", "key", start, end, tx->trace_ids[i], TRACE_FLOW_IN | TRACE_FLOW_OUT, NULL);
+        }
+        tx->nr_trace_ids = 0;
+    }
+    tx->len = 0;
+    return 0;
+}
+
+static int board_tx(struct board *b, struct tx_buffer *tx, const unsigned char *data, size_t len)
+{
+    if (tx->len + len > sizeof(tx->data) && board_tx_flush(b, tx) < 0) {
+        return -1;
+    }
+    memcpy(tx->data + tx->len, data, len);
+    tx->len += len;
+    return 0;
+}
+
+// Write one of the board's lanes while the budget stays above floor
+static int board_drain_lane(struct board *b, struct tx_buffer *tx, int lane, double floor, uint64_t now)
+{
+    struct lane *l = &b->lanes[lane];
+
+    while (l->head != l->tail) {
+        struct frame *f = &l->queue[l->tail % LANE_QUEUE_SIZE];
+
+        if (b->link_tokens - f->len < floor) {
+            b->link_blocked = true;
+            break;
+        }
+        if (board_tx(b, tx, f->data, f->len) < 0) {
+            return -1;
+        }
+        l->tail++;
+
+        if (f->data[0] == PLAYER_IDENTIFIER) {
+            b->last_slot = f->data[1];
+        }
+        if (verbose) {
+            printf("%s: lane %d: %x %x\n", b->device, lane, f->data[0], f->data[1]);
+        }
+        b->link_tokens -= f->len;
+        board_lane_written(b, lane, f, now);
+        if (frame_is_key(f)) {
+            board_key_written(b, players > 1 ? b->last_slot : 0, f, now);
+        }
+
+        // Anything after a baud change request would arrive at the wrong rate
+        if (f->data[0] == BAUD_IDENTIFIER && b->baud_pending >= 0) {
+            b->baud_sent = true;
+            // Frames queued ahead of it may have taken a while on a bad link
+            b->baud_deadline = now + 1000000000ULL;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// With a tic lead, input is held back and goes out in one batch timed to
+// land just before the board's next sample
+static bool board_tic_hold(const struct board *b, uint64_t now)
+{
+    return tic_lead_us && b->tic_synced &&
+           now + tic_lead_us * 1000ULL < board_tic_start(b, b->tic + 1);
+}
+
+// Work out when a key frame just written reaches the board, from what is
+// still in flight on the link, and whether that is in time for the sample
+// following its arrival at the forwarder. On time means within the last
+// quarter tic before the sample, early means it waits at the board longer.
+static void board_tic_account(struct board *b, const struct frame *f, uint64_t now)
+{
+    if (!b->tic_synced) {
+        return;
+    }
+
+    double in_flight = link_capacity(b) - b->link_tokens;
+    uint64_t arrival = now + (in_flight > 0 ? in_flight : 0) * 1e9 / link_rate(b);
+    uint64_t sample = board_tic_start(b, board_tic(b, f->queued) + 1);
+
+    if (arrival > sample) {
+        stat_add(&b->stats->frames_missed, 1);
+        stat_add(&b->stats->frames_tics_late, (arrival - sample) / TIC_NS + 1);
+    } else if (sample - arrival <= TIC_NS / 4) {
+        stat_add(&b->stats->frames_on_time, 1);
+    } else {
+        stat_add(&b->stats->frames_early, 1);
+    }
+}
+
+// The board sampled its input. Pull our tic phase towards it, gently so a
+// marker delayed on the way doesn't drag the phase around.
+static void board_tic_marker(struct board *b, uint64_t now)
+{
+    // The marker was on the wire for a few bytes' time before it got here
+    uint64_t t = now - 8 * 1e9 / link_rate(b);
+
+    stat_add(&b->stats->tic_markers, 1);
+    if (b->tic_synced && b->parser.marker_value > b->marker_tic + 1) {
+        stat_add(&b->stats->tic_markers_missed, b->parser.marker_value - b->marker_tic - 1);
+    }
+    b->marker_tic = b->parser.marker_value;
+
+    if (!b->tic_synced || t - b->last_marker > 1000000000ULL) {
+        b->tic_phase = t % TIC_NS;
+        b->tic_synced = true;
+    } else {
+        int64_t error = (t - b->tic_phase) % TIC_NS;
+        if (error >= (int64_t)TIC_NS / 2) {
+            error -= TIC_NS;
+        }
+        stat_add(&b->stats->tic_phase_error_us,
+                 (error < 0 ? -error : error) / 1000 - b->stats->tic_phase_error_us);
+        b->tic_phase = (b->tic_phase + TIC_NS + error / 4) % TIC_NS;
+    }
+    b->last_marker = t;
+}
+
+// Some key frames never reached the board, and it can't say which. Put
+// every key written recently back the way its player has it now.
+static void board_key_resync(struct board *b)
+{
+    uint8_t seen[MAX_PLAYERS][KEY_CODES / 8] = { 0 };
+    uint32_t n = b->keys_written < KEY_LOG_SIZE ? b->keys_written : KEY_LOG_SIZE;
+    int slot = -1;
+
+    stat_add(&b->stats->key_resyncs, 1);
+
+    for (uint32_t k = b->keys_written - n; k != b->keys_written; k++) {
+        const struct key_record *r = &b->key_log[k % KEY_LOG_SIZE];
+
+        if (r->slot < 0 || r->slot >= MAX_PLAYERS || seen[r->slot][r->code / 8] & (1 << (r->code % 8))) {
+            continue;
+        }
+        seen[r->slot][r->code / 8] |= 1 << (r->code % 8);
+
+        // Keys of a player that has gone are released
+        bool held = false;
+        for (int i = 0; i < b->nr_sessions; i++) {
+            const struct session *s = b->sessions[i];
+            if (s->slot == r->slot) {
+                held = s->held[r->code / 8] & (1 << (r->code % 8));
+                break;
+            }
+        }
+
+        if (players > 1 && r->slot != slot) {
+            board_queue_frame(b, LANE_INPUT, PLAYER_IDENTIFIER, r->slot);
+            slot = r->slot;
+        }
+        struct frame *f = board_queue_frame(b, LANE_INPUT, RELEASE_IDENTIFIER, 0);
+        if (f) {
+            frame_set_key(f, held, r->code);
+        }
+    }
+}
+
+// Frames given up on are taken to be missing from the board's count
+static void board_key_lost(struct board *b, uint32_t lost)
+{
+    stat_add(&b->stats->key_frames_lost, lost);
+    b->ack_offset += lost;
+    b->keys_acked += lost;
+    board_key_resync(b);
+}
+
+// The board has applied marker_first key frames, modulo 65536, the last of
+// them in tic marker_value
+static void board_key_ack(struct board *b, uint64_t now)
+{
+    // The ack was on the wire for a dozen bytes' time before it got here
+    uint64_t t = now - 12 * 1e9 / link_rate(b);
+    uint32_t outstanding = b->keys_written - b->keys_acked;
+    uint16_t n = b->parser.marker_first + b->ack_offset - b->keys_acked;
+    bool resumed = !b->acks_seen;
+
+    if (!key_acks) {
+        return;
+    }
+    stat_add(&b->stats->key_acks, 1);
+    b->acks_seen = true;
+    b->last_ack = now;
+
+    if (verbose) {
+        printf("%s: Board applied %u key frames, the last in tic %u\n",
+               b->device, b->parser.marker_first, b->parser.marker_value);
+    }
+
+    if (n > outstanding) {
+        // More than was ever written. After a timeout some of what was
+        // given up on arrived after all, otherwise the board has started
+        // counting over.
+        b->ack_offset = b->keys_written - b->parser.marker_first;
+        b->keys_acked = b->keys_written;
+        if (!resumed) {
+            fprintf(stderr, "%s: Board's key frame count jumped, resyncing\n", b->device);
+            board_key_resync(b);
+        }
+        return;
+    }
+
+    for (; n; n--, b->keys_acked++) {
+        // Fell out of the log while the board was catching up
+        if (b->keys_written - b->keys_acked > KEY_LOG_SIZE) {
+            continue;
+        }
+
+        const struct key_record *r = &b->key_log[b->keys_acked % KEY_LOG_SIZE];
+        unsigned long latency = t > r->written ? (t - r->written) / 1000 : 0;
+
+        stat_add(&b->stats->key_frames_acked, 1);
+        stat_add(&b->stats->key_ack_latency_us_sum, latency);
+        if (latency > b->stats->key_ack_latency_us_max) {
+            stat_add(&b->stats->key_ack_latency_us_max, latency - b->stats->key_ack_latency_us_max);
+        }
+        if (r->board_tic && b->parser.marker_value > r->board_tic) {
+            stat_add(&b->stats->key_ack_tics_sum, b->parser.marker_value - r->board_tic);
+        }
+        if (r->trace_id && trace_enabled) {
+            char args[32];
+            uint64_t applied = trace_now() - (now - t);
+            snprintf(args, sizeof(args), "\"tic\":%u", b->parser.marker_value);
+            trace_event("board applied", "key", applied, applied, r->trace_id, TRACE_FLOW_IN, args);
+        }
+    }
+
+    // Anything written well before the frames just applied never got there
+    uint32_t lost = 0;
+    for (uint32_t k = b->keys_acked; k != b->keys_written; k++, lost++) {
+        if (b->keys_written - k <= KEY_LOG_SIZE && b->key_log[k % KEY_LOG_SIZE].written + KEY_LOSS_NS > t) {
+            break;
+        }
+    }
+    if (lost) {
+        fprintf(stderr, "%s: Board missed %u key frames, resyncing\n", b->device, lost);
+        board_key_lost(b, lost);
+    }
+}
+
+// Oldest key frame the board hasn't acknowledged that is still in the log
+static uint64_t board_key_oldest(const struct board *b)
+{
+    uint32_t k = b->keys_acked;
+
+    if (b->keys_written - k > KEY_LOG_SIZE) {
+        k = b->keys_written - KEY_LOG_SIZE;
+    }
+    return b->key_log[k % KEY_LOG_SIZE].written;
+}
+
+// With no acks coming at all, the last frames or their acks were lost, or
+// the board has stopped acknowledging. Put the keys right, then wait for
+// an ack before timing anything out again.
+static void board_check_acks(struct board *b, uint64_t now)
+{
+    if (!b->acks_seen || b->keys_acked == b->keys_written ||
+        now - board_key_oldest(b) < KEY_ACK_TIMEOUT_NS || now - b->last_ack < KEY_ACK_TIMEOUT_NS) {
+        return;
+    }
+
+    fprintf(stderr, "%s: No ack for %u key frames, resyncing\n", b->device, b->keys_written - b->keys_acked);
+    b->acks_seen = false;
+    board_key_lost(b, b->keys_written - b->keys_acked);
+}
+
+// Move queued frames onto the serial link. Players take turns one frame
+// at a time so a busy client can't starve the others, and with several
+// players each is limited to tic_cap frames per tic.
+//
+// Frames are only written while the link budget allows, so they wait here
+// rather than in the tty's output queue. Releases may use the whole budget,
+// everything else has to leave LINK_RESERVE percent of it for them. Presses
+// beyond a client's rate limit are dropped, releases are never limited.
+static int board_schedule(struct board *b, uint64_t now)
+{
+    struct tx_buffer tx = { .len = 0, .nr_trace_ids = 0 };
+    int cap = players > 1 ? tic_cap : 0;
+    double reserve = link_capacity(b) * LINK_RESERVE / 100;
+
+    board_refill_link(b, now);
+
+    // Nothing goes out until the board has answered a baud change
+    if (b->baud_sent) {
+        return 0;
+    }
+
+    if (compact && board_backed_up(b)) {
+        for (int i = 0; i < b->nr_sessions; i++) {
+            session_compact(b, b->sessions[i]);
+        }
+    }
+    b->link_blocked = false;
+
+    uint64_t tic = board_tic(b, now);
+    if (tic != b->tic) {
+        b->tic = tic;
+        b->backlog = false;
+        for (int i = 0; i < b->nr_sessions; i++) {
+            struct session *s = b->sessions[i];
+            if (s->slot < 0) {
+                continue;
+            }
+            // Whatever is still queued has missed its tic
+            if ((int32_t)(s->deferred_mark - s->queue_tail) < 0) {
+                s->deferred_mark = s->queue_tail;
+            }
+            stat_add(&b->stats->frames_deferred, s->queue_head - s->deferred_mark);
+            s->deferred_mark = s->queue_head;
+            if (s->queue_head != s->queue_tail) {
+                b->backlog = true;
+            }
+            s->sent_this_tic = 0;
+        }
+        b->next_session++;
+    }
+
+    // Releases for players that went away come before anything else
+    if (board_drain_lane(b, &tx, LANE_INPUT, 0, now) < 0) {
+        return -1;
+    }
+
+    bool progress = !board_tic_hold(b, now);
+    while (progress) {
+        progress = false;
+
+        for (int n = 0; n < b->nr_sessions; n++) {
+            struct session *s = b->sessions[(b->next_session + n) % b->nr_sessions];
+
+            if (s->slot < 0 || s->queue_head == s->queue_tail || (cap && s->sent_this_tic >= cap)) {
+                continue;
+            }
+
+            struct frame *f = &s->queue[s->queue_tail % FRAME_QUEUE_SIZE];
+            bool release = frame_is_release(f);
+            bool switching = players > 1 && s->slot != b->last_slot;
+            int need = switching ? 2 + f->len : f->len;
+
+            if (compact && release && session_hold_release(b, s, f)) {
+                if (s->link_blocked_mark != s->queue_tail + 1) {
+                    s->link_blocked_mark = s->queue_tail + 1;
+                    stat_add(&b->stats->releases_held, 1);
+                }
+                continue;
+            }
+
+            if (b->link_tokens - need < (release ? 0 : reserve)) {
+                if (s->link_blocked_mark != s->queue_tail + 1) {
+                    s->link_blocked_mark = s->queue_tail + 1;
+                    stat_add(&b->stats->frames_link_deferred, 1);
+                }
+                b->link_blocked = true;
+                continue;
+            }
+
+            if (!release && !session_take_token(s, now)) {
+                s->queue_tail++;
+                stat_add(&b->stats->frames_rate_dropped, 1);
+                progress = true;
+                continue;
+            }
+
+            if (switching) {
+                unsigned char player[2] = { PLAYER_IDENTIFIER, s->slot };
+                if (board_tx(b, &tx, player, sizeof(player)) < 0) {
+                    return -1;
+                }
+                b->last_slot = s->slot;
+            }
+            if (board_tx(b, &tx, f->data, f->len) < 0) {
+                return -1;
+            }
+            if (f->trace_id) {
+                tx.trace_ids[tx.nr_trace_ids++] = f->trace_id;
+            }
+            s->queue_tail++;
+            b->link_tokens -= need;
+
+            if (frame_is_press(f)) {
+                int code = frame_key(f);
+                s->held[code / 8] |= 1 << (code % 8);
+                s->recent[s->next_recent].code = code;
+                s->recent[s->next_recent].tic = b->tic;
+                s->next_recent = (s->next_recent + 1) % RECENT_PRESSES;
+            } else if (release) {
+                int code = frame_key(f);
+                s->held[code / 8] &= ~(1 << (code % 8));
+            }
+
+            if (verbose) {
+                printf("%s: %x %x\n", b->device, f->data[0], frame_key(f));
+            }
+            board_lane_written(b, LANE_INPUT, f, now);
+            board_key_written(b, s->slot, f, now);
+            board_tic_account(b, f, now);
+            s->sent_this_tic++;
+            stat_add(&b->stats->frames_forwarded, 1);
+            progress = true;
+        }
+    }
+
+    // Forwarder traffic only gets what input left over, and never the reserve
+    for (int lane = LANE_CONTROL; lane < NR_LANES && !b->baud_sent; lane++) {
+        if (board_drain_lane(b, &tx, lane, reserve, now) < 0) {
+            return -1;
+        }
+    }
+
+    return board_tx_flush(b, &tx);
+}
+
+// How long poll may sleep before board_schedule has more work to do
+static int board_timeout(struct board *b, uint64_t now)
+{
+    // Output is stopped until the board answers or the request times out
+    if (b->baud_sent) {
+        return now < b->baud_deadline ? (b->baud_deadline - now) / 1000000 + 1 : 0;
+    }
+
+    // Link budget frees up a frame's worth in well under a millisecond
+    if (b->link_blocked) {
+        return 1;
+    }
+
+    for (int lane = 0; lane < NR_LANES; lane++) {
+        if (b->lanes[lane].head != b->lanes[lane].tail) {
+            return 0;
+        }
+    }
+
+    uint64_t deadline = UINT64_MAX;
+
+    for (int i = 0; i < b->nr_sessions; i++) {
+        struct session *s = b->sessions[i];
+        if (s->slot >= 0 && s->queue_head != s->queue_tail) {
+            deadline = board_tic_start(b, b->tic + 1);
+            if (board_tic_hold(b, now)) {
+                deadline -= tic_lead_us * 1000ULL;
+            }
+            break;
+        }
+    }
+
+    if (heartbeat_ms && b->nr_sessions) {
+        uint64_t next = b->last_output + heartbeat_ms * 1000000ULL;
+        deadline = next < deadline ? next : deadline;
+    }
+
+    if (link_errors) {
+        uint64_t next = b->link_checked + 1000000000ULL;
+        deadline = next < deadline ? next : deadline;
+        if (b->baud_sent && b->baud_deadline < deadline) {
+            deadline = b->baud_deadline;
+        }
+    }
+
+    if (b->acks_seen && b->keys_acked != b->keys_written) {
+        uint64_t oldest = board_key_oldest(b);
+        uint64_t next = (oldest > b->last_ack ? oldest : b->last_ack) + KEY_ACK_TIMEOUT_NS;
+        deadline = next < deadline ? next : deadline;
+    }
+
+    if (timeout_ms) {
+        for (int i = 0; i < b->nr_sessions; i++) {
+            struct session *s = b->sessions[i];
+            uint64_t next = s->last_rx + timeout_ms * 1000000ULL;
+            if (s->heartbeats && next < deadline) {
+                deadline = next;
+            }
+        }
+    }
+
+    if (deadline == UINT64_MAX) {
+        return -1;
+    }
+    return deadline > now ? (deadline - now) / 1000000 + 1 : 0;
+}
+
+// Map the shared memory ring and doorbell handed over by a local client
+static void session_attach_shm(struct board *b, struct session *s, int ring_fd, int doorbell_fd)
+{
+    struct stat st;
+    void *ring = MAP_FAILED;
+
+    if (!s->shm && fstat(ring_fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct shm_ring)) {
+        ring = mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    }
+    close(ring_fd);
+
+    if (ring == MAP_FAILED) {
+        fprintf(stderr, "%s: Ignoring invalid shared memory ring\n", b->device);
+        close(doorbell_fd);
+        return;
+    }
+
+    // The queue may be full when we come back to drain the rest
+    fcntl(doorbell_fd, F_SETFL, fcntl(doorbell_fd, F_GETFL) | O_NONBLOCK);
+
+    s->shm = ring;
+    s->doorbell_fd = doorbell_fd;
+    stat_add(&b->stats->shm_attached, 1);
+    printf("%s: Local client attached shared memory ring\n", b->device);
+}
+
+// Receive from a unix socket, picking up any file descriptors passed along
+static ssize_t session_recv_local(struct board *b, struct session *s, char *buffer, size_t len)
+{
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = buffer, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t bytes_read = recvmsg(s->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (bytes_read <= 0) {
+        return bytes_read;
+    }
+
+    // Descriptors that did fit still arrive when the rest were cut off,
+    // and whatever we don't take has to be closed or it leaks
+    bool want_shm = (unsigned char)buffer[0] == SHM_IDENTIFIER;
+    if (msg.msg_flags & MSG_CTRUNC) {
+        fprintf(stderr, "%s: Too many file descriptors from local client, ignoring them\n", b->device);
+        want_shm = false;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        const unsigned char *data = CMSG_DATA(cmsg);
+        int nr_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        if (want_shm && nr_fds == 2) {
+            int fds[2];
+            memcpy(fds, data, sizeof(fds));
+            session_attach_shm(b, s, fds[0], fds[1]);
+            want_shm = false;
+            continue;
+        }
+
+        for (int i = 0; i < nr_fds; i++) {
+            int fd;
+            memcpy(&fd, data + i * sizeof(int), sizeof(int));
+            close(fd);
+        }
+    }
+
+    return bytes_read;
+}
+
+// Drain what a local client has published in its shared memory ring, as
+// far as there is room in the session's frame queue
+static int session_drain_shm(struct board *b, struct session *s)
+{
+    struct shm_ring *shm = s->shm;
+    uint64_t count;
+
+    if (read(s->doorbell_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        return -1;
+    }
+
+    uint32_t tail = shm->tail;
+    uint32_t head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+    if (head - tail > SHM_RING_SIZE) {
+        fprintf(stderr, "%s: Corrupt shared memory ring\n", b->device);
+        return -1;
+    }
+
+    while (tail != head && session_queue_space(s)) {
+        uint32_t offset = tail % SHM_RING_SIZE;
+        uint32_t len = head - tail;
+        if (len > SHM_RING_SIZE - offset) {
+            len = SHM_RING_SIZE - offset;
+        }
+        if (len > 2 * session_queue_space(s)) {
+            len = 2 * session_queue_space(s);
+        }
+
+        session_input(b, s, (const char *)shm->data + offset, len);
+        s->last_rx = now_ns();
+        tail += len;
+        __atomic_store_n(&shm->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+static void sha1(const unsigned char *data, size_t len, unsigned char digest[20])
+{
+    uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    // Room for the 0x80 byte and the length after the data, in whole blocks
+    size_t total = (len + 8) / 64 * 64 + 64;
+
+    for (size_t block = 0; block < total; block += 64) {
+        uint32_t w[80];
+
+        for (int i = 0; i < 64; i++) {
+            size_t pos = block + i;
+            unsigned char c = pos < len ? data[pos] : pos == len ? 0x80 : 0;
+            if (pos >= total - 8) {
+                c = (uint64_t)len * 8 >> (8 * (total - 1 - pos));
+            }
+            if (i % 4 == 0) {
+                w[i / 4] = 0;
+            }
+            w[i / 4] |= (uint32_t)c << (8 * (3 - i % 4));
+        }
+        for (int i = 16; i < 80; i++) {
+            uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = x << 1 | x >> 31;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            uint32_t t = (a << 5 | a >> 27) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = b << 30 | b >> 2;
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    for (int i = 0; i < 20; i++) {
+        digest[i] = h[i / 4] >> (8 * (3 - i % 4));
+    }
+}
+
+static void base64_encode(const unsigned char *data, size_t len, char *out)
+{
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = data[i] << 16;
+        if (i + 1 < len) {
+            v |= data[i + 1] << 8;
+        }
+        if (i + 2 < len) {
+            v |= data[i + 2];
+        }
+        *out++ = alphabet[v >> 18 & 0x3f];
+        *out++ = alphabet[v >> 12 & 0x3f];
+        *out++ = i + 1 < len ? alphabet[v >> 6 & 0x3f] : '=';
+        *out++ = i + 2 < len ? alphabet[v & 0x3f] : '=';
+    }
+    *out = '\0';
+}
+
+// Find a header in a request, returning its value and setting *len
+static const char *ws_header(const char *request, const char *name, size_t *len)
+{
+    size_t name_len = strlen(name);
+
+    for (const char *line = strstr(request, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (!strncasecmp(line + 2, name, name_len) && line[2 + name_len] == ':') {
+            const char *value = line + 3 + name_len;
+            value += strspn(value, " \t");
+            *len = strcspn(value, " \t\r");
+            return value;
+        }
+    }
+    *len = 0;
+    return NULL;
+}
+
+// Browsers say which page opened a connection. Without a check any site
+// the player visits could type into the game. Programs other than
+// browsers send no Origin and are let in like native clients.
+static bool ws_origin_allowed(const char *origin, size_t origin_len, const char *host, size_t host_len)
+{
+    if (!origin) {
+        return true;
+    }
+
+    for (int i = 0; i < nr_ws_origins; i++) {
+        if (!strcmp(ws_origins[i], "*") ||
+            (strlen(ws_origins[i]) == origin_len && !strncasecmp(ws_origins[i], origin, origin_len))) {
+            return true;
+        }
+    }
+
+    // Same origin, a page from the host and port the browser reached us at
+    const char *authority = memmem(origin, origin_len, "://", 3);
+    if (!authority || !host) {
+        return false;
+    }
+    authority += 3;
+    size_t authority_len = origin_len - (authority - origin);
+    return authority_len == host_len && !strncasecmp(authority, host, host_len);
+}
+
+// Collect a browser's upgrade request and answer it. Returns how much of
+// buffer belonged to the request, or -1 if it isn't one we can accept.
+static ssize_t session_ws_handshake(struct board *b, struct session *s, const char *buffer, size_t len)
+{
+    struct websocket *ws = &s->ws;
+    size_t start = ws->request_len;
+    size_t take = WS_REQUEST_MAX - 1 - start < len ? WS_REQUEST_MAX - 1 - start : len;
+
+    memcpy(ws->request + start, buffer, take);
+    ws->request_len += take;
+    ws->request[ws->request_len] = '\0';
+
+    char *end = strstr(ws->request, "\r\n\r\n");
+    if (!end) {
+        if (ws->request_len == WS_REQUEST_MAX - 1) {
+            fprintf(stderr, "%s: WebSocket request from %s too long\n", b->device, s->peer);
+            return -1;
+        }
+        return len;
+    }
+    *end = '\0';
+
+    size_t key_len, origin_len, host_len;
+    const char *key = ws_header(ws->request, "Sec-WebSocket-Key", &key_len);
+    const char *origin = ws_header(ws->request, "Origin", &origin_len);
+    const char *host = ws_header(ws->request, "Host", &host_len);
+
+    if (strncmp(ws->request, "GET ", 4) || !key || !key_len || key_len > 64) {
+        static const char bad_request[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
+        fprintf(stderr, "%s: Not a WebSocket request from %s\n", b->device, s->peer);
+        send(s->fd, bad_request, strlen(bad_request), MSG_DONTWAIT | MSG_NOSIGNAL);
+        return -1;
+    }
+
+    if (!ws_origin_allowed(origin, origin_len, host, host_len)) {
+        static const char forbidden[] = "HTTP/1.1 403 Forbidden\r\n\r\n";
+        fprintf(stderr, "%s: Refusing WebSocket from %s opened by %.*s, see --ws-origin\n",
+                b->device, s->peer, (int)origin_len, origin);
+        stat_add(&b->stats->websockets_refused, 1);
+        send(s->fd, forbidden, strlen(forbidden), MSG_DONTWAIT | MSG_NOSIGNAL);
+        return -1;
+    }
+
+    char accept_key[64 + sizeof(WS_GUID)];
+    unsigned char digest[20];
+    char encoded[32];
+    char response[160];
+    snprintf(accept_key, sizeof(accept_key), "%.*s%s", (int)key_len, key, WS_GUID);
+    sha1((const unsigned char *)accept_key, strlen(accept_key), digest);
+    base64_encode(digest, sizeof(digest), encoded);
+    int response_len = snprintf(response, sizeof(response),
+                                "HTTP/1.1 101 Switching Protocols\r\n"
+                                "Upgrade: websocket\r\n"
+                                "Connection: Upgrade\r\n"
+                                "Sec-WebSocket-Accept: %s\r\n\r\n", encoded);
+    // The socket is fresh, anything less than all of it means trouble
+    if (send(s->fd, response, response_len, MSG_DONTWAIT | MSG_NOSIGNAL) != response_len) {
+        return -1;
+    }
+
+    ws->state = WS_OPEN;
+    s->cursor = b->ring_head;
+    ws->fb_cursor = b->fb_ring_head;
+    stat_add(&b->stats->websocket_connections, 1);
+
+    // It needs the palette and a key frame before deltas mean anything.
+    // The palette is its own, the ring is shared with the other browsers.
+    ws->palette[0] = FB_PALETTE;
+    ws->palette[1] = b->fb.seq;
+    memcpy(ws->palette + 2, b->fb.palette, sizeof(b->fb.palette));
+    ws->palette_pending = true;
+    b->nr_websockets++;
+    board_queue_frame(b, LANE_CONTROL, FRAMEBUFFER_IDENTIFIER, 1);
+
+    return end + 4 - ws->request - start;
+}
+
+// Unwrap the frames a browser sends, unmasking the payload in place and
+// passing it on as if it came from a native client. Returns -1 once the
+// browser closes or breaks the framing.
+static int session_ws_input(struct board *b, struct session *s, char *buffer, size_t len)
+{
+    struct websocket *ws = &s->ws;
+    size_t i = 0;
+    size_t out = 0;
+
+    if (ws->state == WS_HANDSHAKE) {
+        ssize_t used = session_ws_handshake(b, s, buffer, len);
+        if (used < 0) {
+            return -1;
+        }
+        i = used;
+    }
+
+    while (i < len) {
+        if (!ws->in_payload) {
+            unsigned char *h = ws->in_header;
+            h[ws->in_header_len++] = buffer[i++];
+            if (ws->in_header_len < 2) {
+                continue;
+            }
+            // Browsers always mask, anything else isn't one
+            if (!(h[1] & 0x80)) {
+                return -1;
+            }
+            int size = h[1] & 0x7f;
+            int need = 2 + (size == 126 ? 2 : size == 127 ? 8 : 0) + 4;
+            if (ws->in_header_len < need) {
+                continue;
+            }
+
+            int opcode = h[0] & 0x0f;
+            if (opcode == 0x8) {
+                return -1;
+            }
+            ws->in_left = size;
+            if (size >= 126) {
+                ws->in_left = 0;
+                for (int n = 2; n < need - 4; n++) {
+                    ws->in_left = ws->in_left << 8 | h[n];
+                }
+            }
+            memcpy(ws->in_mask, h + need - 4, sizeof(ws->in_mask));
+            // Pings and pongs carry nothing for the board
+            ws->in_discard = opcode > 0x8;
+            ws->in_pos = 0;
+            ws->in_header_len = 0;
+            ws->in_payload = ws->in_left != 0;
+            continue;
+        }
+
+        unsigned char c = buffer[i++] ^ ws->in_mask[ws->in_pos++ % 4];
+        if (!ws->in_discard) {
+            buffer[out++] = c;
+        }
+        if (--ws->in_left == 0) {
+            ws->in_payload = false;
+        }
+    }
+
+    if (out && !s->spectator) {
+        session_input(b, s, buffer, out);
+    }
+    return 0;
+}
+
+// Read from a client socket into the session's frame queue
+static void board_client_read(struct board *b, int i)
+{
+    struct session *s = b->sessions[i];
+    char buffer[RX_BUFFER_SIZE];
+    size_t len = sizeof(buffer);
+    ssize_t bytes_read;
+
+    // Its input no longer means anything, it is closed next time round
+    if (s->evicted) {
+        return;
+    }
+
+    if (!s->spectator && len > 2 * session_queue_space(s)) {
+        len = 2 * session_queue_space(s);
+    }
+
+    if (s->local) {
+        bytes_read = session_recv_local(b, s, buffer, len);
+    } else {
+        bytes_read = recv(s->fd, buffer, len, 0);
+    }
+    if (bytes_read <= 0) {
+        board_close_session(b, i);
+        return;
+    }
+    s->last_rx = now_ns();
+
+    if (s->ws.state != WS_NONE) {
+        if (session_ws_input(b, s, buffer, bytes_read) < 0) {
+            board_close_session(b, i);
+        }
+        return;
+    }
+
+    // Spectators can't send input, just watch for them hanging up
+    if (s->spectator) {
+        return;
+    }
+
+    session_input(b, s, buffer, bytes_read);
+}
+
+// Add board output to the ring shared by all sessions
+static void board_ring_commit(struct board *b, size_t len)
+{
+    b->ring_head += len;
+    if (b->ring_written < b->ring_head) {
+        b->ring_written = b->ring_head;
+    }
+    b->last_output = now_ns();
+}
+
+static void board_ring_append(struct board *b, const char *data, size_t len)
+{
+    size_t offset = b->ring_head % RING_SIZE;
+    size_t first = RING_SIZE - offset < len ? RING_SIZE - offset : len;
+    memcpy(b->ring + offset, data, first);
+    memcpy(b->ring, data + first, len - first);
+    board_ring_commit(b, len);
+}
+
+// Push new ring contents out to every session
+static void board_flush_all(struct board *b)
+{
+    for (int i = b->nr_sessions - 1; i >= 0; i--) {
+        struct session *s = b->sessions[i];
+
+        // Messages can't be cut short, so a lapped browser goes whatever it is
+        if (s->ws.state == WS_OPEN && (b->ring_written - s->cursor > RING_SIZE ||
+                                       b->fb_ring_head - s->ws.fb_cursor > FB_RING_SIZE)) {
+            printf("%s: Dropping slow WebSocket client\n", b->device);
+            stat_add(&b->stats->websockets_dropped, 1);
+            board_close_session(b, i);
+            continue;
+        }
+
+        // The ring has lapped this reader. Spectators are dropped, they
+        // must never hold up the board. The player just loses output.
+        if (b->ring_written - s->cursor > RING_SIZE) {
+            if (s->spectator) {
+                printf("%s: Dropping slow spectator\n", b->device);
+                stat_add(&b->stats->spectators_dropped, 1);
+                board_close_session(b, i);
+                continue;
+            }
+            stat_add(&b->stats->client_tx_dropped, b->ring_head - s->cursor);
+            s->cursor = b->ring_head;
+        }
+
+        if (board_flush_session(b, s) < 0) {
+            board_close_session(b, i);
+        }
+    }
+}
+
+// Keep clients hearing from us while the board is quiet, and drop players
+// that have stopped heartbeating. Closing a player releases its keys and
+// frees its slot for whoever is waiting.
+static void board_heartbeat(struct board *b, uint64_t now)
+{
+    if (timeout_ms) {
+        for (int i = b->nr_sessions - 1; i >= 0; i--) {
+            struct session *s = b->sessions[i];
+
+            // Nothing is read while the queue is full, that isn't silence
+            if (!s->heartbeats || (!s->spectator && !session_queue_space(s))) {
+                s->last_rx = now;
+                continue;
+            }
+            if (now - s->last_rx >= timeout_ms * 1000000ULL) {
+                printf("%s: Client timed out\n", b->device);
+                stat_add(&b->stats->sessions_timed_out, 1);
+                board_close_session(b, i);
+            }
+        }
+    }
+
+    if (heartbeat_ms && b->nr_sessions && now - b->last_output >= heartbeat_ms * 1000000ULL) {
+        // Don't glue the heartbeat onto a line the board is half way through
+        if (!b->parser.line_start) {
+            board_ring_append(b, "\n", 1);
+            b->parser.line_start = true;
+        }
+        board_ring_append(b, HEARTBEAT_LINE, strlen(HEARTBEAT_LINE));
+        stat_add(&b->stats->heartbeats_sent, 1);
+        board_flush_all(b);
+    }
+}
+
+// Apply a frame's ops to the pixels. Runs turn into memset and memcpy,
+// which do the heavy lifting a wide store at a time.
+static bool framebuffer_apply(unsigned char *pixels, const unsigned char *ops, size_t len)
+{
+    size_t pos = 0;
+
+    for (size_t i = 0; i < len; ) {
+        unsigned char op = ops[i++];
+        size_t count = (op & (op < FB_OP_REPEAT ? 0x7f : 0x3f)) + 1;
+
+        if (pos + count > FB_SIZE) {
+            return false;
+        }
+        if (op >= FB_OP_LITERAL) {
+            if (i + count > len) {
+                return false;
+            }
+            memcpy(pixels + pos, ops + i, count);
+            i += count;
+        } else if (op >= FB_OP_REPEAT) {
+            if (i == len) {
+                return false;
+            }
+            memset(pixels + pos, ops[i++], count);
+        }
+        pos += count;
+    }
+
+    return true;
+}
+
+// Write out as much of the current frame as the output takes without
+// blocking. A reader that goes away is looked for again on the next frame.
+static void framebuffer_flush(struct board *b)
+{
+    struct framebuffer *fb = &b->fb;
+
+    while (fb->ppm_sent < fb->ppm_len) {
+        ssize_t written = write(fb->out_fd, fb->ppm + fb->ppm_sent, fb->ppm_len - fb->ppm_sent);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return;
+            }
+            close(fb->out_fd);
+            fb->out_fd = -1;
+            fb->ppm_len = 0;
+            return;
+        }
+        fb->ppm_sent += written;
+    }
+    fb->ppm_len = 0;
+}
+
+// Hand a decoded frame to the output as a PPM image, so a stream of them
+// can go straight into a viewer or encoder
+static void framebuffer_output(struct board *b)
+{
+    struct framebuffer *fb = &b->fb;
+
+    stat_add(&b->stats->fb_frames, 1);
+
+    if (fb->out_fd < 0) {
+        // A FIFO can't be opened for writing until someone reads it
+        fb->out_fd = open(fb->path, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK | O_CLOEXEC, 0644);
+        if (fb->out_fd < 0) {
+            stat_add(&b->stats->fb_frames_dropped, 1);
+            return;
+        }
+    }
+
+    // Still busy with the last one, the reader is slower than the board
+    if (fb->ppm_len) {
+        stat_add(&b->stats->fb_frames_dropped, 1);
+        return;
+    }
+
+    size_t header = strlen(PPM_HEADER);
+    unsigned char *out = (unsigned char *)fb->ppm + header;
+    memcpy(fb->ppm, PPM_HEADER, header);
+    for (int i = 0; i < FB_SIZE; i++) {
+        const unsigned char *rgb = &fb->palette[fb->pixels[i] * 3];
+        out[3 * i] = rgb[0];
+        out[3 * i + 1] = rgb[1];
+        out[3 * i + 2] = rgb[2];
+    }
+    fb->ppm_len = header + 3 * FB_SIZE;
+    fb->ppm_sent = 0;
+    framebuffer_flush(b);
+}
+
+// Lost track of the frames, nothing more can be shown until a key frame
+static void framebuffer_resync(struct board *b)
+{
+    stat_add(&b->stats->fb_errors, 1);
+    if (b->fb.synced) {
+        b->fb.synced = false;
+        board_queue_frame(b, LANE_CONTROL, FRAMEBUFFER_IDENTIFIER, 1);
+    }
+}
+
+// A whole record has arrived
+static void framebuffer_record(struct board *b)
+{
+    struct framebuffer *fb = &b->fb;
+    unsigned char *record = b->parser.record;
+    size_t len = b->parser.record_len;
+
+    stat_add(&b->stats->fb_record_bytes, len);
+
+    if (len < 4 || len > FB_RECORD_MAX) {
+        framebuffer_resync(b);
+        return;
+    }
+    // The only bytes the board checksums, so they stand in for the link
+    if (fwd_crc16(record, len - 2) != (record[len - 2] << 8 | record[len - 1])) {
+        stat_add(&b->stats->crc_errors, 1);
+        b->link_errors++;
+        framebuffer_resync(b);
+        return;
+    }
+
+    // Browsers get records as they are, and decode them themselves
+    if (b->nr_websockets) {
+        uint32_t record_len = len - 2;
+        fb_ring_write(b, &record_len, sizeof(record_len));
+        fb_ring_write(b, record, record_len);
+    }
+
+    uint8_t seq = record[1];
+    bool lost = fb->seen && seq != (uint8_t)(fb->seq + 1);
+    fb->seen = true;
+    fb->seq = seq;
+    if (lost) {
+        framebuffer_resync(b);
+    }
+
+    const unsigned char *body = record + 2;
+    size_t body_len = len - 4;
+
+    switch (record[0]) {
+        case FB_PALETTE:
+            if (body_len == sizeof(fb->palette)) {
+                memcpy(fb->palette, body, sizeof(fb->palette));
+            }
+            break;
+        case FB_KEY_FRAME:
+            memset(fb->pixels, 0, FB_SIZE);
+            fb->synced = true;
+            // Fall through
+        case FB_DELTA_FRAME:
+            if (!fb->synced) {
+                stat_add(&b->stats->fb_frames_dropped, 1);
+                break;
+            }
+            if (!framebuffer_apply(fb->pixels, body, body_len)) {
+                framebuffer_resync(b);
+                break;
+            }
+            if (fb->path) {
+                framebuffer_output(b);
+            }
+            break;
+    }
+}
+
+static unsigned long icount_errors(const struct serial_icounter_struct *icount)
+{
+    return icount->frame + icount->overrun + icount->parity + icount->buf_overrun;
+}
+
+// UART errors since the last call. Ptys and some USB adapters don't count
+// them, for those only CRC failures are seen.
+static unsigned long board_uart_errors(struct board *b)
+{
+    struct serial_icounter_struct icount;
+
+    if (!b->icount) {
+        return 0;
+    }
+    if (ioctl(b->serial_fd, TIOCGICOUNT, &icount) < 0) {
+        b->icount = false;
+        return 0;
+    }
+
+    unsigned long errors = icount_errors(&icount) - b->uart_errors;
+    b->uart_errors = icount_errors(&icount);
+    stat_add(&b->stats->uart_errors, errors);
+    return errors;
+}
+
+// The next BAUD_RATES entry below (dir < 0) or above the current baud
+static int board_next_baud(const struct board *b, int dir)
+{
+    if (dir < 0) {
+        for (int i = NR_BAUD_RATES - 1; i >= 0; i--) {
+            if (baud_rates[i] < b->baud) {
+                return i;
+            }
+        }
+    } else {
+        for (int i = 0; i < NR_BAUD_RATES; i++) {
+            if (baud_rates[i] > b->baud) {
+                return baud_rates[i] <= b->top_baud ? i : -1;
+            }
+        }
+    }
+    return -1;
+}
+
+static void board_request_baud(struct board *b, int index)
+{
+    printf("%s: Asking board to switch from %d to %d baud\n", b->device, b->baud, baud_rates[index]);
+    if (board_queue_frame(b, LANE_CONTROL, BAUD_IDENTIFIER, index)) {
+        b->baud_pending = index;
+    }
+}
+
+// The board is switching rates, follow it and confirm at the new one
+static void board_baud_ack(struct board *b, uint64_t now)
+{
+    if (b->baud_pending < 0 || b->parser.marker_value != (uint32_t)b->baud_pending) {
+        return;
+    }
+
+    int baud = baud_rates[b->baud_pending];
+    if (fwd_serial_speed(b->serial_fd, baud) < 0) {
+        // Left to time out, the board goes back by itself
+        return;
+    }
+
+    printf("%s: Serial link now at %d baud\n", b->device, baud);
+    if (baud > b->baud) {
+        b->probe_until = now + 2000000000ULL;
+    }
+    b->baud = baud;
+    b->baud_pending = -1;
+    b->baud_sent = false;
+    b->link_tokens = 0;
+    b->link_updated = now;
+    board_queue_frame(b, LANE_CONTROL, BAUD_IDENTIFIER, b->parser.marker_value);
+    stat_add(&b->stats->baud_changes, 1);
+    stat_add(&b->stats->baud, baud - b->stats->baud);
+
+    // Whatever arrived mid switch was garbled, don't count it against the new rate
+    board_uart_errors(b);
+    b->link_errors = 0;
+}
+
+// Once a second look at how many errors the link has had. Too many and
+// it falls back to the next slower baud. After a quiet probe_interval it
+// tries the next faster one, waiting twice as long each time that fails.
+static void board_check_link(struct board *b, uint64_t now)
+{
+    if (!link_errors) {
+        return;
+    }
+
+    // Output is held while a request is on the wire, give up on it as
+    // soon as it is due rather than at the next once a second check
+    if (b->baud_sent && now >= b->baud_deadline) {
+        fprintf(stderr, "%s: Board didn't answer, staying at %d baud\n", b->device, b->baud);
+        stat_add(&b->stats->baud_changes_failed, 1);
+        b->baud_pending = -1;
+        b->baud_sent = false;
+        b->probe_at = now + b->probe_interval * 1000000000ULL;
+    }
+
+    if (now - b->link_checked < 1000000000ULL) {
+        return;
+    }
+    b->link_checked = now;
+
+    unsigned long errors = board_uart_errors(b) + b->link_errors;
+    b->link_errors = 0;
+
+    if (b->baud_pending >= 0) {
+        return;
+    }
+
+    if (errors >= (unsigned long)link_errors) {
+        if (now < b->probe_until) {
+            b->probe_interval *= 2;
+            if (b->probe_interval > PROBE_INTERVAL_MAX) {
+                b->probe_interval = PROBE_INTERVAL_MAX;
+            }
+        }
+        b->probe_until = 0;
+        b->probe_at = now + b->probe_interval * 1000000000ULL;
+
+        int slower = board_next_baud(b, -1);
+        if (slower >= 0) {
+            fprintf(stderr, "%s: %lu serial errors in the last second\n", b->device, errors);
+            board_request_baud(b, slower);
+        }
+        return;
+    }
+
+    // A step up that has held is the new normal
+    if (b->probe_until && now >= b->probe_until) {
+        b->probe_until = 0;
+        b->probe_interval = probe_interval;
+    }
+
+    if (!errors && now >= b->probe_at) {
+        int faster = board_next_baud(b, 1);
+        if (faster >= 0) {
+            board_request_baud(b, faster);
+        }
+    }
+}
+
+// Pick sound lines out of the text going to clients. The offset of the
+// line in the ring is what ties the clients' traces of it to ours.
+static void board_trace_text(struct board *b, unsigned char c, uint64_t offset, bool line_start)
+{
+    if (line_start) {
+        b->sound_line = c == 'P';
+        b->sound_offset = offset;
+        b->sound = 0;
+    } else if (b->sound_line && c >= '0' && c <= '9') {
+        b->sound = b->sound * 10 + c - '0';
+    } else if (b->sound_line && c == '\n') {
+        char args[32];
+        uint64_t t = trace_now();
+        snprintf(args, sizeof(args), "\"sound\":%u", b->sound);
+        trace_event("sound line", "sound", t, t, trace_sound_id(b->index, b->sound_offset),
+                    TRACE_FLOW_OUT, args);
+        b->sound_line = false;
+    }
+}
+
+// Serial input is read straight into the ring past ring_head. Split it
+// into text for the clients, which stays where it is, and framebuffer
+// records. Text only moves to close the gap a record leaves behind.
+static void board_serial_input(struct board *b, size_t len, uint64_t now)
+{
+    uint64_t out = b->ring_head;    // Where the next byte of text belongs
+
+    for (uint64_t in = b->ring_head; in != b->ring_head + len; in++) {
+        unsigned char c = b->ring[in % RING_SIZE];
+        bool line_start = b->parser.line_start;
+
+        switch (fwd_parse(&b->parser, c)) {
+            case FWD_HIDDEN:
+                continue;
+            case FWD_RECORD:
+                framebuffer_record(b);
+                continue;
+            case FWD_MARKER:
+                if (b->parser.marker == TIC_MARKER) {
+                    board_tic_marker(b, now);
+                } else if (b->parser.marker == KEY_ACK) {
+                    board_key_ack(b, now);
+                } else {
+                    board_baud_ack(b, now);
+                }
+                continue;
+        }
+
+        if (trace_enabled) {
+            board_trace_text(b, c, out, line_start);
+        }
+        if (out != in) {
+            b->ring[out % RING_SIZE] = c;
+        }
+        out++;
+    }
+
+    if (out != b->ring_head) {
+        board_ring_commit(b, out - b->ring_head);
+    }
+}
+
+// Read from serial port and write to the output ring shared by all sessions
+static int board_serial_to_tcp(struct board *b)
+{
+    // Sessions send from the ring, so this is the only copy of the data
+    size_t offset = b->ring_head % RING_SIZE;
+    size_t first = RING_SIZE - offset < SERIAL_READ_SIZE ? RING_SIZE - offset : SERIAL_READ_SIZE;
+    struct iovec iov[2] = {
+        { .iov_base = b->ring + offset, .iov_len = first },
+        { .iov_base = b->ring, .iov_len = SERIAL_READ_SIZE - first },
+    };
+    uint64_t start = trace_enabled ? trace_now() : 0;
+    ssize_t bytes_read = readv(b->serial_fd, iov, first < SERIAL_READ_SIZE ? 2 : 1);
+    if (bytes_read <= 0) {
+        perror("Error reading serial port");
+        return -1;
+    }
+    if (trace_enabled) {
+        char args[32];
+        snprintf(args, sizeof(args), "\"bytes\":%zd", bytes_read);
+        trace_event("serial read", "serial", start, trace_now(), 0, 0, args);
+    }
+    stat_add(&b->stats->serial_rx_bytes, bytes_read);
+    if (b->ring_written < b->ring_head + bytes_read) {
+        b->ring_written = b->ring_head + bytes_read;
+    }
+
+    if (verbose) {
+        printf("%s: Serial->TCP: ", b->device);
+        for (int i = 0; i < bytes_read; i++) {
+            printf("%02x ", (unsigned char)b->ring[(b->ring_head + i) % RING_SIZE]);
+        }
+        printf("(");
+        for (int i = 0; i < bytes_read; i++) {
+            char c = b->ring[(b->ring_head + i) % RING_SIZE];
+            printf("%c", isprint((unsigned char)c) ? c : '.');
+        }
+        printf(")\n");
+    }
+
+    board_serial_input(b, bytes_read, now_ns());
+    board_flush_all(b);
+    return 0;
+}
+
+// Event loop serving a single board, one per thread. Nothing in here is
+// shared with other boards so they never contend with each other.
+static void *board_thread(void *arg)
+{
+    struct board *b = arg;
+
+    printf("%s: Waiting for connection on port %d...\n", b->device, b->port);
+    trace_thread(b->device);
+
+    while (1) {
+        struct pollfd fds[MAX_POLL_FDS];
+        int session_idx[MAX_SESSIONS];
+        int doorbell_idx[MAX_SESSIONS];
+        int nfds = 7;
+
+        // Pick up shared memory input left behind while queues were full
+        for (int i = b->nr_sessions - 1; i >= 0; i--) {
+            struct session *s = b->sessions[i];
+            if (s->evicted) {
+                board_close_session(b, i);
+            } else if (s->shm && s->shm->tail != __atomic_load_n(&s->shm->head, __ATOMIC_ACQUIRE) &&
+                session_drain_shm(b, s) < 0) {
+                board_close_session(b, i);
+            }
+        }
+
+        uint64_t now = now_ns();
+        board_heartbeat(b, now);
+        board_check_link(b, now);
+        board_check_acks(b, now);
+        board_seat_pending(b);
+        board_announce_players(b);
+
+        if (board_schedule(b, now) < 0) {
+            break;
+        }
+
+        fds[0].fd = b->serial_fd;
+        fds[0].events = POLLIN;
+        // Players beyond the configured number wait for a slot, up to a
+        // point. After that they wait in the backlog.
+        fds[1].fd = b->nr_pending < MAX_PENDING ? b->server_fd : -1;
+        fds[1].events = POLLIN;
+        fds[2].fd = b->nr_pending < MAX_PENDING ? b->unix_fd : -1;
+        fds[2].events = POLLIN;
+        fds[3].fd = b->spectator_fd;
+        fds[3].events = POLLIN;
+        fds[4].fd = b->fb.ppm_len ? b->fb.out_fd : -1;
+        fds[4].events = POLLOUT;
+        fds[5].fd = b->nr_pending < MAX_PENDING ? b->websocket_fd : -1;
+        fds[5].events = POLLIN;
+        fds[6].fd = b->nr_pending < MAX_PENDING ? b->handoff[0] : -1;
+        fds[6].events = POLLIN;
+        for (int i = 0; i < b->nr_sessions; i++) {
+            struct session *s = b->sessions[i];
+
+            session_idx[i] = nfds;
+            fds[nfds].fd = s->fd;
+            // Stop reading from players whose queue is full
+            fds[nfds].events = s->spectator || session_queue_space(s) ? POLLIN : 0;
+            if (session_has_output(b, s)) {
+                fds[nfds].events |= POLLOUT;
+            }
+            nfds++;
+
+            doorbell_idx[i] = -1;
+            if (s->shm) {
+                doorbell_idx[i] = nfds;
+                fds[nfds].fd = s->doorbell_fd;
+                fds[nfds].events = POLLIN;
+                nfds++;
+            }
+        }
+
+        int nr_sessions = b->nr_sessions;
+        if (poll(fds, nfds, board_timeout(b, now)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        // Walk backwards, closing a session moves the last one into its slot
+        for (int i = nr_sessions - 1; i >= 0; i--) {
+            short revents = fds[session_idx[i]].revents;
+
+            if (doorbell_idx[i] >= 0 && fds[doorbell_idx[i]].revents &&
+                session_drain_shm(b, b->sessions[i]) < 0) {
+                board_close_session(b, i);
+                continue;
+            }
+            if (revents & POLLOUT && board_flush_session(b, b->sessions[i]) < 0) {
+                board_close_session(b, i);
+                continue;
+            }
+            if (revents & (POLLIN | POLLHUP | POLLERR)) {
+                board_client_read(b, i);
+            }
+        }
+
+        if (fds[1].revents) {
+            board_accept(b, b->server_fd, false, false);
+        }
+        if (fds[2].revents) {
+            board_accept(b, b->unix_fd, false, false);
+        }
+        if (fds[3].revents) {
+            board_accept(b, b->spectator_fd, true, false);
+        }
+        if (fds[5].revents) {
+            board_accept(b, b->websocket_fd, false, true);
+        }
+        if (fds[6].revents) {
+            board_receive_handoff(b);
+        }
+        if (fds[4].revents) {
+            framebuffer_flush(b);
+        }
+
+        if (fds[0].revents) {
+            if (board_serial_to_tcp(b) < 0) {
+                break;
+            }
+        }
+    }
+
+    fprintf(stderr, "%s: Giving up on board\n", b->device);
+    __atomic_store_n(&shared->routes[b->index].ready, false, __ATOMIC_RELEASE);
+    // Let the players know now rather than when the board is reopened
+    while (b->nr_sessions) {
+        board_close_session(b, b->nr_sessions - 1);
+    }
+    return NULL;
+}
+
+static int listen_tcp(int port, int backlog)
+{
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    // Allow a restarted forwarder to take its ports back straight away
+    int one = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (workers > 1) {
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    }
+
+    struct sockaddr_in address;
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("Bind failed");
+        close(server_fd);
+        return -1;
+    }
+
+    if (listen(server_fd, backlog) < 0) {
+        perror("Listen failed");
+        close(server_fd);
+        return -1;
+    }
+
+    return server_fd;
+}
+
+// Listen on an abstract unix socket, named after the board's TCP port
+static int listen_unix(int port, int backlog)
+{
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    struct sockaddr_un address;
+    char port_str[16];
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    // Leading NUL puts the name in the abstract namespace
+    int len = snprintf(address.sun_path + 1, sizeof(address.sun_path) - 1, UNIX_SOCKET_NAME, port_str);
+    socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+
+    if (bind(server_fd, (struct sockaddr *)&address, addrlen) < 0) {
+        perror("Bind failed");
+        close(server_fd);
+        return -1;
+    }
+
+    if (listen(server_fd, backlog) < 0) {
+        perror("Listen failed");
+        close(server_fd);
+        return -1;
+    }
 
-#define PORT 65432
-#define DEVICE "/dev/ttyUSB0"
-#define BAUD_RATE 115200
+    printf("Listening for local clients on @%s\n", address.sun_path + 1);
+    return server_fd;
+}
 
-#define RX_BUFFER_SIZE 2
-#define TX_BUFFER_SIZE 256
+// Listen on the board's TCP ports. With several workers every one of them
+// does, and the kernel spreads new connections between them.
+static int board_listen(struct board *b)
+{
+    b->spectator_fd = -1;
+    b->websocket_fd = -1;
+    b->server_fd = listen_tcp(b->port, 1);
+    if (b->server_fd < 0) {
+        return -1;
+    }
 
-static int tcp_socket_fd;
-static int serial_port_fd;
-static bool verbose;
+    if (b->spectator_port) {
+        b->spectator_fd = listen_tcp(b->spectator_port, 16);
+        if (b->spectator_fd < 0) {
+            close(b->server_fd);
+            b->server_fd = -1;
+            return -1;
+        }
+    }
+
+    if (b->websocket_port) {
+        b->websocket_fd = listen_tcp(b->websocket_port, 4);
+        if (b->websocket_fd < 0) {
+            if (b->spectator_fd >= 0) {
+                close(b->spectator_fd);
+                b->spectator_fd = -1;
+            }
+            close(b->server_fd);
+            b->server_fd = -1;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Open the board's serial port and ports. Whether this succeeds or not,
+// board_close() puts it back for another try.
+static int board_open(struct board *b)
+{
+    // A restarted worker or reopened board starts its counters over
+    memset(b->stats, 0, sizeof(*b->stats));
+
+    b->serial_fd = b->server_fd = b->spectator_fd = b->unix_fd = b->websocket_fd = -1;
+    b->fb.out_fd = -1;
+    b->top_baud = b->baud;
+    b->last_slot = -1;
+    b->link_tokens = link_capacity(b);
+    b->link_updated = now_ns();
+    b->last_output = b->link_updated;
 
-static speed_t baudrate_to_speed_t(int baudrate)
-{
-    switch (baudrate) {
-        case 50:
-            return B50;
-        case 75:
-            return B75;
-        case 110:
-            return B110;
-        case 134:
-            return B134;
-        case 150:
-            return B150;
-        case 200:
-            return B200;
-        case 300:
-            return B300;
-        case 600:
-            return B600;
-        case 1200:
-            return B1200;
-        case 1800:
-            return B1800;
-        case 2400:
-            return B2400;
-        case 4800:
-            return B4800;
-        case 9600:
-            return B9600;
-        case 19200:
-            return B19200;
-        case 38400:
-            return B38400;
-        case 57600:
-            return B57600;
-        case 115200:
-            return B115200;
-        case 230400:
-            return B230400;
-        case 460800:
-            return B460800;
-        case 500000:
-            return B500000;
-        case 576000:
-            return B576000;
-        case 921600:
-            return B921600;
-        case 1000000:
-            return B1000000;
-        case 1152000:
-            return B1152000;
-        case 1500000:
-            return B1500000;
-        case 2000000:
-            return B2000000;
-        case 2500000:
-            return B2500000;
-        case 3000000:
-            return B3000000;
-        case 3500000:
-            return B3500000;
-        case 4000000:
-            return B4000000;
-        default:
-            fprintf(stderr, "Error: Invalid or unsupported baud rate: %d\n", baudrate);
-            return (speed_t)-1;
-    }
-}
-
-// Function to configure the serial port
-static int configure_serial_port(int fd, int baud_rate)
-{
-    struct termios tty;
-    if (tcgetattr(fd, &tty) != 0) {
-        perror("Error from tcgetattr");
+    b->serial_fd = fwd_serial_open(b->device, b->baud, O_SYNC);
+    if (b->serial_fd < 0) {
         return -1;
     }
 
-    // Set baud rate
-    speed_t b = baudrate_to_speed_t(baud_rate);
-    cfsetospeed(&tty, b);
-    cfsetispeed(&tty, b);
+    struct serial_icounter_struct icount;
+    b->icount = ioctl(b->serial_fd, TIOCGICOUNT, &icount) == 0;
+    b->uart_errors = b->icount ? icount_errors(&icount) : 0;
+    b->baud_pending = -1;
+    b->probe_interval = probe_interval;
+    b->link_checked = b->link_updated;
+    stat_add(&b->stats->baud, b->baud);
 
-    // Set other serial port settings
-    tty.c_cflag &= ~PARENB;      // No parity
-    tty.c_cflag &= ~CSTOPB;      // 1 stop bit
-    tty.c_cflag &= ~CSIZE;       // Clear size bits
-    tty.c_cflag |= CS8;          // 8 data bits
-    tty.c_cflag &= ~CRTSCTS;     // Disable hardware flow control
-    tty.c_cflag |= CREAD | CLOCAL; // Enable reading and ignore modem controls
+    if (board_listen(b) < 0) {
+        return -1;
+    }
+
+    b->unix_fd = listen_unix(b->port, 1);
+    if (b->unix_fd < 0) {
+        return -1;
+    }
 
-    tty.c_lflag &= ~ICANON;      // Disable canonical mode
-    tty.c_lflag &= ~ECHO;        // Disable echo
-    tty.c_lflag &= ~ECHOE;       // Disable erase
-    tty.c_lflag &= ~ECHONL;      // Disable newline echo
-    tty.c_lflag &= ~ISIG;        // Disable signal characters
+    // Sessions come from pools sized up front. Players get an extra one
+    // for a connection on its way out after being taken over.
+    if (pool_init(&b->player_pool, sizeof(struct session), players + MAX_PENDING + 1,
+                  &b->stats->pool_free[0]) < 0 ||
+        pool_init(&b->spectator_pool, sizeof(struct session), b->spectator_port ? max_spectators : 0,
+                  &b->stats->pool_free[1]) < 0) {
+        perror("malloc");
+        return -1;
+    }
 
-    tty.c_iflag &= ~(IXON | IXOFF | IXANY); // Disable software flow control
-    tty.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL); // Disable special handling
+    if (b->spectator_port) {
+        printf("Spectators can watch %s on port %d\n", b->device, b->spectator_port);
+    }
 
-    tty.c_oflag &= ~OPOST;       // Prevent special interpretation of output bytes
-    tty.c_oflag &= ~ONLCR;       // Prevent newline to carriage return conversion
+    if (b->websocket_port) {
+        b->fb_ring = heap_alloc(FB_RING_SIZE);
+        if (!b->fb_ring) {
+            perror("malloc");
+            return -1;
+        }
+        printf("Browsers can play %s on port %d\n", b->device, b->websocket_port);
+    }
 
-    tty.c_cc[VTIME] = 10;        // Wait for up to 1 second (10 * 0.1s)
-    tty.c_cc[VMIN] = 1;          // Non-blocking read
+    if (use_keymap) {
+        board_queue_frame(b, LANE_CONTROL, KEYMAP_IDENTIFIER, 1);
+    }
+    if (tic_sync) {
+        board_queue_frame(b, LANE_CONTROL, TIC_SYNC_IDENTIFIER, 1);
+    }
+    if (key_acks) {
+        board_queue_frame(b, LANE_CONTROL, KEY_ACK_IDENTIFIER, 1);
+    }
 
-    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
-        perror("Error from tcsetattr");
+    // Records are always taken out of the text, frames only decoded on request
+    unsigned char *record = heap_alloc(FB_RECORD_MAX);
+    b->fb.pixels = heap_alloc(FB_SIZE);
+    if (!record || !b->fb.pixels) {
+        perror("malloc");
         return -1;
     }
+    fwd_parser_init(&b->parser, record);
+    for (int i = 0; i < 256; i++) {
+        memset(&b->fb.palette[3 * i], i, 3);
+    }
+    if (fb_output) {
+        b->fb.ppm = heap_alloc(strlen(PPM_HEADER) + 3 * FB_SIZE);
+        b->fb.path = heap_alloc(strlen(fb_output) + 16);
+        if (!b->fb.ppm || !b->fb.path) {
+            perror("malloc");
+            return -1;
+        }
+        // Each board gets its own stream
+        if (nr_boards > 1) {
+            sprintf(b->fb.path, "%s.%d", fb_output, b->index);
+        } else {
+            strcpy(b->fb.path, fb_output);
+        }
+        board_queue_frame(b, LANE_CONTROL, FRAMEBUFFER_IDENTIFIER, 1);
+        printf("Writing %s framebuffer to %s\n", b->device, b->fb.path);
+    }
 
+    printf("Server listening on port %d and forwarding to %s...\n", b->port, b->device);
     return 0;
 }
 
-// Thread to read from TCP socket and write to serial port
-static void *tcp_to_serial_thread(void* arg)
+// Undo board_open(), however far it got, and leave the board as configured
+static void board_close(struct board *b)
 {
-    char buffer[RX_BUFFER_SIZE];
-    ssize_t bytes_read;
-    while ((bytes_read = recv(tcp_socket_fd, buffer, sizeof(buffer), 0)) > 0) {
-        if (verbose) {
-            printf("%x %x\n", buffer[0], buffer[1]);
+    int fds[] = { b->serial_fd, b->server_fd, b->spectator_fd, b->unix_fd, b->websocket_fd, b->fb.out_fd };
+
+    while (b->nr_sessions) {
+        board_close_session(b, b->nr_sessions - 1);
+    }
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
         }
-        if (write(serial_port_fd, buffer, bytes_read) != bytes_read) {
-            perror("write");
-            exit(1);
+    }
+    free(b->player_pool.slab);
+    free(b->spectator_pool.slab);
+    free(b->fb_ring);
+    free(b->parser.record);
+    free(b->fb.pixels);
+    free(b->fb.ppm);
+    free(b->fb.path);
+
+    // Fallen back links start at the configured baud again
+    b->baud = b->top_baud;
+    memset(&b->serial_fd, 0, offsetof(struct board, handoff) - offsetof(struct board, serial_fd));
+}
+
+// Write all board counters in "name{labels} value" form
+static void stats_dump(FILE *f)
+{
+    static const struct {
+        const char *name;
+        size_t offset;
+    } counters[] = {
+        {"connections",      offsetof(struct board_stats, connections)},
+        {"local_connections", offsetof(struct board_stats, local_connections)},
+        {"websocket_connections", offsetof(struct board_stats, websocket_connections)},
+        {"websockets_dropped", offsetof(struct board_stats, websockets_dropped)},
+        {"websockets_refused", offsetof(struct board_stats, websockets_refused)},
+        {"shm_attached",     offsetof(struct board_stats, shm_attached)},
+        {"spectators",       offsetof(struct board_stats, spectators)},
+        {"spectators_dropped", offsetof(struct board_stats, spectators_dropped)},
+        {"client_rx_bytes",     offsetof(struct board_stats, client_rx_bytes)},
+        {"client_tx_bytes",     offsetof(struct board_stats, client_tx_bytes)},
+        {"client_tx_dropped",   offsetof(struct board_stats, client_tx_dropped)},
+        {"serial_rx_bytes",  offsetof(struct board_stats, serial_rx_bytes)},
+        {"serial_tx_bytes",  offsetof(struct board_stats, serial_tx_bytes)},
+        {"frames_forwarded", offsetof(struct board_stats, frames_forwarded)},
+        {"frames_deferred",  offsetof(struct board_stats, frames_deferred)},
+        {"frames_rate_dropped", offsetof(struct board_stats, frames_rate_dropped)},
+        {"frames_link_deferred", offsetof(struct board_stats, frames_link_deferred)},
+        {"frames_compacted", offsetof(struct board_stats, frames_compacted)},
+        {"frames_unmapped",  offsetof(struct board_stats, frames_unmapped)},
+        {"frames_rejected",  offsetof(struct board_stats, frames_rejected)},
+        {"releases_held",    offsetof(struct board_stats, releases_held)},
+        {"keys_released",    offsetof(struct board_stats, keys_released)},
+        {"heartbeats_sent",  offsetof(struct board_stats, heartbeats_sent)},
+        {"sessions_timed_out", offsetof(struct board_stats, sessions_timed_out)},
+        {"takeovers",        offsetof(struct board_stats, takeovers)},
+        {"tic_markers",      offsetof(struct board_stats, tic_markers)},
+        {"tic_markers_missed", offsetof(struct board_stats, tic_markers_missed)},
+        {"tic_phase_error_us", offsetof(struct board_stats, tic_phase_error_us)},
+        {"frames_early",     offsetof(struct board_stats, frames_early)},
+        {"frames_on_time",   offsetof(struct board_stats, frames_on_time)},
+        {"frames_missed",    offsetof(struct board_stats, frames_missed)},
+        {"frames_tics_late", offsetof(struct board_stats, frames_tics_late)},
+        {"fb_frames",        offsetof(struct board_stats, fb_frames)},
+        {"fb_record_bytes",  offsetof(struct board_stats, fb_record_bytes)},
+        {"fb_errors",        offsetof(struct board_stats, fb_errors)},
+        {"fb_frames_dropped", offsetof(struct board_stats, fb_frames_dropped)},
+        {"uart_errors",      offsetof(struct board_stats, uart_errors)},
+        {"crc_errors",       offsetof(struct board_stats, crc_errors)},
+        {"baud",             offsetof(struct board_stats, baud)},
+        {"baud_changes",     offsetof(struct board_stats, baud_changes)},
+        {"baud_changes_failed", offsetof(struct board_stats, baud_changes_failed)},
+        {"connections_routed", offsetof(struct board_stats, connections_routed)},
+        {"key_acks",         offsetof(struct board_stats, key_acks)},
+        {"key_frames_acked", offsetof(struct board_stats, key_frames_acked)},
+        {"key_ack_latency_us_sum", offsetof(struct board_stats, key_ack_latency_us_sum)},
+        {"key_ack_latency_us_max", offsetof(struct board_stats, key_ack_latency_us_max)},
+        {"key_ack_tics_sum", offsetof(struct board_stats, key_ack_tics_sum)},
+        {"key_frames_lost",  offsetof(struct board_stats, key_frames_lost)},
+        {"key_resyncs",      offsetof(struct board_stats, key_resyncs)},
+    };
+
+    static const char *lane_names[NR_LANES] = { "input", "control", "bulk" };
+
+    fprintf(f, "forwarder_heap_allocations %lu\n", __atomic_load_n(&shared->heap_allocations, __ATOMIC_RELAXED));
+
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        for (int j = 0; j < nr_boards; j++) {
+            const struct board *b = &boards[j];
+            const unsigned long *value = (const void *)((const char *)b->stats + counters[i].offset);
+            fprintf(f, "forwarder_%s{board=\"%d\",device=\"%s\",port=\"%d\"} %lu\n",
+                    counters[i].name, b->index, b->device, b->port, stat_read(value));
+        }
+    }
+
+    for (int j = 0; j < nr_boards; j++) {
+        const struct board *b = &boards[j];
+        for (int lane = 0; lane < NR_LANES; lane++) {
+            fprintf(f, "forwarder_lane_frames{board=\"%d\",lane=\"%s\"} %lu\n",
+                    b->index, lane_names[lane], stat_read(&b->stats->lanes[lane].frames));
+            fprintf(f, "forwarder_lane_latency_us_sum{board=\"%d\",lane=\"%s\"} %lu\n",
+                    b->index, lane_names[lane], stat_read(&b->stats->lanes[lane].latency_us_sum));
+            fprintf(f, "forwarder_lane_latency_us_max{board=\"%d\",lane=\"%s\"} %lu\n",
+                    b->index, lane_names[lane], stat_read(&b->stats->lanes[lane].latency_us_max));
+        }
+        fprintf(f, "forwarder_pool_free{board=\"%d\",pool=\"players\"} %lu\n",
+                b->index, stat_read(&b->stats->pool_free[0]));
+        fprintf(f, "forwarder_pool_free{board=\"%d\",pool=\"spectators\"} %lu\n",
+                b->index, stat_read(&b->stats->pool_free[1]));
+    }
+}
+
+// Minimal HTTP endpoint so the stats can be scraped with curl or nc
+static void *stats_thread(void *arg)
+{
+    int server_fd = *(int *)arg;
+
+    while (1) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+        // Swallow the request if there is one, but don't wait long for it
+        struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+        char request[1024];
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        (void)!recv(fd, request, sizeof(request), 0);
+
+        FILE *f = fdopen(fd, "w");
+        if (!f) {
+            close(fd);
+            continue;
         }
+        fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n");
+        stats_dump(f);
+        fflush(f);
+        shutdown(fd, SHUT_WR);
+        fclose(f);
     }
 
     return NULL;
 }
 
-// Thread to read from serial port and write to TCP socket
-static void *serial_to_tcp_thread(void* arg)
+static int stats_start(int port)
 {
-    char buffer[TX_BUFFER_SIZE];
-    ssize_t bytes_read;
-    while ((bytes_read = read(serial_port_fd, buffer, sizeof(buffer))) > 0) {
-        if (verbose) {
-            printf("Serial->TCP: ");
-            for (int i = 0; i < bytes_read; i++) {
-                printf("%02x ", (unsigned char)buffer[i]);
-            }
-            printf("(");
-            for (int i = 0; i < bytes_read; i++) {
-                printf("%c", isprint(buffer[i]) ? buffer[i] : '.');
+    int server_fd = listen_tcp(port, 4);
+    if (server_fd < 0) {
+        return -1;
+    }
+
+    static int stats_fd;
+    pthread_t handle;
+    stats_fd = server_fd;
+    pthread_create(&handle, NULL, stats_thread, &stats_fd);
+    pthread_detach(handle);
+
+    printf("Stats available on port %d\n", port);
+    return 0;
+}
+
+static bool board_owned(const struct board *b)
+{
+    return shared->routes[b->index].owner == worker;
+}
+
+// Accept connections for boards other workers serve and pass them on
+static void *router_thread(void *arg)
+{
+    struct pollfd fds[3 * MAX_BOARDS];
+    struct board *owner[3 * MAX_BOARDS];
+    unsigned char kind[3 * MAX_BOARDS];
+    int nfds = 0;
+
+    for (int i = 0; i < nr_boards; i++) {
+        struct board *b = &boards[i];
+        int listeners[3] = { b->server_fd, b->spectator_fd, b->websocket_fd };
+
+        if (board_owned(b)) {
+            continue;
+        }
+        for (int k = ACCEPT_PLAYER; k <= ACCEPT_WEBSOCKET; k++) {
+            if (listeners[k] >= 0) {
+                fds[nfds].fd = listeners[k];
+                fds[nfds].events = POLLIN;
+                owner[nfds] = b;
+                kind[nfds] = k;
+                nfds++;
             }
-            printf(")\n");
         }
-        
-        // Send data to TCP client
-        if (send(tcp_socket_fd, buffer, bytes_read, 0) != bytes_read) {
-            perror("Failed to send serial data to TCP client");
+    }
+
+    while (1) {
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
             break;
         }
+
+        for (int i = 0; i < nfds; i++) {
+            if (!fds[i].revents) {
+                continue;
+            }
+            int fd = accept4(fds[i].fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0) {
+                continue;
+            }
+            // Nobody to take it while the owner restarts
+            if (__atomic_load_n(&shared->routes[owner[i]->index].ready, __ATOMIC_ACQUIRE)) {
+                board_handoff(owner[i], fd, kind[i]);
+            }
+            close(fd);
+        }
     }
 
     return NULL;
 }
 
+// Back off before trying something again that has just failed
+struct restart {
+    int delay;              // Seconds
+    uint64_t at;            // Earliest time to try again
+    uint64_t started;       // When it last came up, 0 if it never has
+};
+
+static void restart_failed(struct restart *r, uint64_t now)
+{
+    if (r->started && now - r->started >= RESTART_RESET * 1000000000ULL) {
+        r->delay = 0;
+    }
+    r->delay = r->delay ? r->delay * 2 : 1;
+    if (r->delay > RESTART_DELAY_MAX) {
+        r->delay = RESTART_DELAY_MAX;
+    }
+    r->at = now + r->delay * 1000000000ULL;
+}
+
+// Open a board and start serving it, or schedule another try
+static bool board_start(struct board *b, struct restart *r, uint64_t now)
+{
+    if (board_open(b) < 0) {
+        board_close(b);
+        restart_failed(r, now);
+        fprintf(stderr, "%s: Failed to open board, retrying in %d seconds\n", b->device, r->delay);
+        return false;
+    }
+    r->started = now;
+    __atomic_store_n(&shared->routes[b->index].ready, true, __ATOMIC_RELEASE);
+    pthread_create(&b->thread, NULL, board_thread, b);
+    return true;
+}
+
+// Serve this worker's boards and route connections for the rest. Boards
+// that fail are reopened on their own while the others carry on, so this
+// only returns if routing fails.
+static int worker_run(void)
+{
+    struct restart restarts[MAX_BOARDS] = { 0 };
+    bool started[MAX_BOARDS] = { false };
+    bool routing = false;
+    bool serving = false;
+
+    for (int i = 0; i < nr_boards; i++) {
+        if (board_owned(&boards[i])) {
+            serving = true;
+        } else {
+            if (board_listen(&boards[i]) < 0) {
+                return 1;
+            }
+            routing = true;
+        }
+    }
+
+    // More workers than boards, some only ever route
+    if (!serving) {
+        __atomic_store_n(&running, true, __ATOMIC_RELAXED);
+        router_thread(NULL);
+        return 1;
+    }
+
+    uint64_t now = now_ns();
+    for (int i = 0; i < nr_boards; i++) {
+        if (board_owned(&boards[i])) {
+            started[i] = board_start(&boards[i], &restarts[i], now);
+        }
+    }
+    __atomic_store_n(&running, true, __ATOMIC_RELAXED);
+
+    if (routing) {
+        pthread_t handle;
+        pthread_create(&handle, NULL, router_thread, NULL);
+        pthread_detach(handle);
+    }
+
+    // Boards only stop on serial errors
+    while (1) {
+        sleep(1);
+        now = now_ns();
+        for (int i = 0; i < nr_boards; i++) {
+            struct board *b = &boards[i];
+            if (!board_owned(b)) {
+                continue;
+            }
+            if (started[i]) {
+                if (pthread_tryjoin_np(b->thread, NULL) != 0) {
+                    continue;
+                }
+                board_close(b);
+                restart_failed(&restarts[i], now);
+                started[i] = false;
+                fprintf(stderr, "%s: Reopening board in %d seconds\n", b->device, restarts[i].delay);
+            } else if (now >= restarts[i].at) {
+                started[i] = board_start(b, &restarts[i], now);
+            }
+        }
+    }
+}
+
+static pid_t worker_start(int index)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        // Don't outlive the parent restarting us
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        worker = index;
+        if (trace_enabled) {
+            char name[32];
+            snprintf(name, sizeof(name), "forwarder worker %d", index);
+            trace_process(name);
+        }
+        exit(worker_run());
+    }
+    return pid;
+}
+
+// Fork the workers and restart any that die, backing off while they keep
+// dying. Stats are served from here, the counters are in shared memory.
+static int supervise(int stats_port)
+{
+    pid_t pids[MAX_WORKERS];
+    struct restart restarts[MAX_WORKERS] = { 0 };
+
+    for (int i = 0; i < workers; i++) {
+        pids[i] = worker_start(i);
+        if (pids[i] < 0) {
+            return 1;
+        }
+        restarts[i].started = now_ns();
+    }
+
+    if (stats_port && stats_start(stats_port) < 0) {
+        return 1;
+    }
+
+    while (1) {
+        uint64_t now = now_ns();
+        bool waiting = false;
+
+        for (int i = 0; i < workers; i++) {
+            if (pids[i]) {
+                continue;
+            }
+            if (now < restarts[i].at) {
+                waiting = true;
+                continue;
+            }
+            pids[i] = worker_start(i);
+            if (pids[i] < 0) {
+                return 1;
+            }
+            restarts[i].started = now;
+        }
+
+        // Only block while nothing is due for a restart
+        pid_t pid = waitpid(-1, NULL, waiting ? WNOHANG : 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wait");
+            return 1;
+        }
+        if (pid == 0) {
+            sleep(1);
+            continue;
+        }
+
+        for (int i = 0; i < workers; i++) {
+            if (pids[i] != pid) {
+                continue;
+            }
+            for (int j = 0; j < nr_boards; j++) {
+                if (shared->routes[j].owner == i) {
+                    __atomic_store_n(&shared->routes[j].ready, false, __ATOMIC_RELEASE);
+                }
+            }
+            pids[i] = 0;
+            restart_failed(&restarts[i], now_ns());
+            fprintf(stderr, "Worker %d exited, restarting it in %d seconds\n", i, restarts[i].delay);
+        }
+    }
+}
+
+// Parse a key code or value from a keymap, decimal or 0x prefixed hex
+static int parse_key(const char *arg)
+{
+    char *end;
+    long code = strtol(arg, &end, 0);
+    return *arg && !*end && code >= 0 && code < KEY_CODES ? code : -1;
+}
+
+// Load a keymap. Each line maps an evdev code to the key the board should
+// see, "code value", or a chord, "modifier+code value". Keys not listed
+// are dropped.
+static int load_keymap(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    memset(keymap, 0xff, sizeof(keymap));
+
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char source[64], value[64], extra[2];
+        lineno++;
+
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+
+        int fields = sscanf(line, "%63s %63s %1s", source, value, extra);
+        if (fields <= 0) {
+            continue;
+        }
+
+        char *plus = strchr(source, '+');
+        if (plus) {
+            *plus++ = '\0';
+        }
+        int code = parse_key(plus ? plus : source);
+        int modifier = plus ? parse_key(source) : 0;
+        int out = parse_key(value);
+
+        if (fields != 2 || code < 0 || modifier < 0 || out < 0) {
+            fprintf(stderr, "%s:%d: Invalid keymap entry\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+
+        if (!plus) {
+            keymap[code] = out;
+        } else if (nr_chords == MAX_CHORDS) {
+            fprintf(stderr, "%s:%d: At most %d chords are supported\n", path, lineno, MAX_CHORDS);
+            fclose(f);
+            return -1;
+        } else {
+            chords[nr_chords].modifier = modifier;
+            chords[nr_chords].key = code;
+            chords[nr_chords].value = out;
+            nr_chords++;
+        }
+    }
+
+    fclose(f);
+    use_keymap = true;
+    return 0;
+}
+
+// Parse "device:port[:baud[:spectator_port[:websocket_port]]]"
+static int parse_map(const char *arg, struct board *b, int default_baud)
+{
+    char *copy = strdup(arg);
+    char *port = strchr(copy, ':');
+    if (!port) {
+        free(copy);
+        return -1;
+    }
+    *port++ = '\0';
+
+    char *baud = strchr(port, ':');
+    if (baud) {
+        *baud++ = '\0';
+    }
+
+    char *spectator_port = baud ? strchr(baud, ':') : NULL;
+    if (spectator_port) {
+        *spectator_port++ = '\0';
+    }
+
+    char *websocket_port = spectator_port ? strchr(spectator_port, ':') : NULL;
+    if (websocket_port) {
+        *websocket_port++ = '\0';
+    }
+
+    b->device = copy;
+    b->port = atoi(port);
+    b->baud = baud && *baud ? atoi(baud) : default_baud;
+    b->spectator_port = spectator_port ? atoi(spectator_port) : 0;
+    b->websocket_port = websocket_port ? atoi(websocket_port) : 0;
+
+    if (!*copy || b->port <= 0 || b->baud <= 0) {
+        free(copy);
+        return -1;
+    }
+
+    return 0;
+}
+
 static void usage(const char *prog_name)
 {
     fprintf(stderr, "Usage: %s [options]\n\n", prog_name);
@@ -193,6 +3681,61 @@ static void usage(const char *prog_name)
     fprintf(stderr, "  -p, --port <number>     Specify the port number (default %d).\n", PORT);
     fprintf(stderr, "  -d, --device <path>     Specify the serial device (default %s).\n", DEVICE);
     fprintf(stderr, "  -b, --baud <rate>       Specify the baud rate (default %d).\n", BAUD_RATE);
+    fprintf(stderr, "  -S, --spectator-port <number>\n");
+    fprintf(stderr, "                          Serve read-only spectators on this port.\n");
+    fprintf(stderr, "      --max-spectators <number>\n");
+    fprintf(stderr, "                          Spectators allowed per board (default and max %d).\n", MAX_SPECTATORS);
+    fprintf(stderr, "  -W, --websocket-port <number>\n");
+    fprintf(stderr, "                          Serve browser players over WebSocket on this port.\n");
+    fprintf(stderr, "      --ws-origin <origin>\n");
+    fprintf(stderr, "                          Let pages from this origin, e.g. http://host:8000,\n");
+    fprintf(stderr, "                          connect over WebSocket, may be repeated (* for any).\n");
+    fprintf(stderr, "                          Otherwise browsers must come from the same origin.\n");
+    fprintf(stderr, "  -m, --map <dev:port[:baud[:spectator_port[:websocket_port]]]>\n");
+    fprintf(stderr, "                          Serve a board on the given port, may be repeated\n");
+    fprintf(stderr, "                          (overrides -p, -d, -S and -W, baud defaults to -b).\n");
+    fprintf(stderr, "  -P, --players <number>  Serve up to this many players per board (default 1,\n");
+    fprintf(stderr, "                          max %d). Key frames are tagged with the player.\n", MAX_PLAYERS);
+    fprintf(stderr, "  -t, --tic-cap <number>  Frames per player per tic with several players\n");
+    fprintf(stderr, "                          (default %d, 0 for no limit).\n", TIC_CAP);
+    fprintf(stderr, "  -y, --tic-sync          Ask boards for tic markers and align tics with them.\n");
+    fprintf(stderr, "      --tic-lead <us>     Hold input back and send it this long before the\n");
+    fprintf(stderr, "                          board's next tic (implies --tic-sync).\n");
+    fprintf(stderr, "  -r, --rate <number>     Presses per second allowed from each client (default\n");
+    fprintf(stderr, "                          %d, 0 for no limit). Releases are never limited.\n", RATE_LIMIT);
+    fprintf(stderr, "      --burst <number>    Presses a client may send in a burst (default %d,\n", RATE_BURST);
+    fprintf(stderr, "                          1 to %d).\n", FRAME_QUEUE_SIZE);
+    fprintf(stderr, "  -c, --compact           Merge redundant queued key transitions while the\n");
+    fprintf(stderr, "                          serial link is backed up.\n");
+    fprintf(stderr, "  -k, --keymap <file>     Translate key codes to Doom keys on the host, see\n");
+    fprintf(stderr, "                          doom.keymap for the format.\n");
+    fprintf(stderr, "  -f, --fb-output <path>  Ask boards to stream their framebuffer and write it\n");
+    fprintf(stderr, "                          here as a stream of PPM images, with .<board>\n");
+    fprintf(stderr, "                          appended when there are several. A FIFO works,\n");
+    fprintf(stderr, "                          e.g. for ffplay -f image2pipe -c:v ppm.\n");
+    fprintf(stderr, "  -H, --heartbeat <ms>    Send clients a heartbeat line when the board has been\n");
+    fprintf(stderr, "                          quiet this long (default %d, 0 to disable).\n", HEARTBEAT_MS);
+    fprintf(stderr, "  -T, --timeout <ms>      Drop heartbeating clients not heard from this long,\n");
+    fprintf(stderr, "                          releasing their keys (default %d, 0 to disable).\n", TIMEOUT_MS);
+    fprintf(stderr, "      --secret <string>   Token clients must present to take over an existing\n");
+    fprintf(stderr, "                          connection. Without one only the same host may.\n");
+    fprintf(stderr, "      --link-errors <number>\n");
+    fprintf(stderr, "                          Serial errors per second that make a board fall back\n");
+    fprintf(stderr, "                          to a slower baud (default %d, 0 to never change).\n", LINK_ERRORS);
+    fprintf(stderr, "                          Errors are the UART's, where the tty counts them, and\n");
+    fprintf(stderr, "                          CRC failures in framebuffer records, which boards only\n");
+    fprintf(stderr, "                          send with -f or while a browser is watching.\n");
+    fprintf(stderr, "      --probe-interval <seconds>\n");
+    fprintf(stderr, "                          Try a faster baud again after this long without\n");
+    fprintf(stderr, "                          errors (default %d, doubled after each failure).\n", PROBE_INTERVAL);
+    fprintf(stderr, "      --key-acks          Ask boards to acknowledge key frames, to measure when\n");
+    fprintf(stderr, "                          they are applied and put keys right after a loss.\n");
+    fprintf(stderr, "      --trace <file>      Append Chrome trace events here, see tracing.py.\n");
+    fprintf(stderr, "  -w, --workers <number>  Serve the boards from this many processes, sharing\n");
+    fprintf(stderr, "                          the listening ports (default 1). Each board belongs\n");
+    fprintf(stderr, "                          to one worker, the others pass it its connections.\n");
+    fprintf(stderr, "  -s, --stats-port <number>\n");
+    fprintf(stderr, "                          Serve plain text statistics on this port.\n");
     fprintf(stderr, "  -v, --verbose           Enable verbose output.\n");
     fprintf(stderr, "  -h, --help              Display this help message and exit.\n");
 }
@@ -202,18 +3745,54 @@ int main(int argc, char *argv[])
     int port = PORT;
     char *device = DEVICE;
     int baud = BAUD_RATE;
+    int spectator_port = 0;
+    int websocket_port = 0;
+    int stats_port = 0;
+    const char *maps[MAX_BOARDS];
+    const char *trace_path = NULL;
+    int nr_maps = 0;
     int c;
     int option_index = 0;
-    const char *short_options = "hp:d:b:v";
+    const char *short_options = "hp:d:b:S:W:m:P:t:yr:ck:f:H:T:w:s:v";
     static const struct option long_options[] = {
-        {"port",    required_argument, 0, 'p'},
-        {"device",  required_argument, 0, 'd'},
-        {"baud",    required_argument, 0, 'b'},
-        {"verbose", no_argument, 0, 'v'},
+        {"port",       required_argument, 0, 'p'},
+        {"device",     required_argument, 0, 'd'},
+        {"baud",       required_argument, 0, 'b'},
+        {"spectator-port", required_argument, 0, 'S'},
+        {"websocket-port", required_argument, 0, 'W'},
+        {"ws-origin",  required_argument, 0, 'O'},
+        {"max-spectators", required_argument, 0, 'M'},
+        {"map",        required_argument, 0, 'm'},
+        {"players",    required_argument, 0, 'P'},
+        {"tic-cap",    required_argument, 0, 't'},
+        {"tic-sync",   no_argument,       0, 'y'},
+        {"tic-lead",   required_argument, 0, 'L'},
+        {"rate",       required_argument, 0, 'r'},
+        {"burst",      required_argument, 0, 'B'},
+        {"compact",    no_argument,       0, 'c'},
+        {"keymap",     required_argument, 0, 'k'},
+        {"fb-output",  required_argument, 0, 'f'},
+        {"heartbeat",  required_argument, 0, 'H'},
+        {"timeout",    required_argument, 0, 'T'},
+        {"secret",     required_argument, 0, 'A'},
+        {"link-errors", required_argument, 0, 'E'},
+        {"probe-interval", required_argument, 0, 'I'},
+        {"key-acks",   no_argument,       0, 'K'},
+        {"trace",      required_argument, 0, 'R'},
+        {"workers",    required_argument, 0, 'w'},
+        {"stats-port", required_argument, 0, 's'},
+        {"verbose",    no_argument, 0, 'v'},
         {"help",                    0, 0,   0},
         {0,         0,                 0,  0 } // Marks the end of the array
     };
 
+    // Counters and routes, where every worker and the stats endpoint see them
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
     while ((c = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1) {
         switch (c) {
             case 'p':
@@ -225,6 +3804,114 @@ int main(int argc, char *argv[])
             case 'b':
                 baud = atoi(optarg);
                 break;
+            case 'S':
+                spectator_port = atoi(optarg);
+                break;
+            case 'W':
+                websocket_port = atoi(optarg);
+                break;
+            case 'O':
+                if (nr_ws_origins == MAX_WS_ORIGINS) {
+                    fprintf(stderr, "Error: At most %d WebSocket origins are supported\n", MAX_WS_ORIGINS);
+                    exit(1);
+                }
+                ws_origins[nr_ws_origins++] = optarg;
+                break;
+            case 'M':
+                max_spectators = atoi(optarg);
+                if (max_spectators < 1 || max_spectators > MAX_SPECTATORS) {
+                    fprintf(stderr, "Error: Spectators must be between 1 and %d\n", MAX_SPECTATORS);
+                    exit(1);
+                }
+                break;
+            case 'm':
+                if (nr_maps == MAX_BOARDS) {
+                    fprintf(stderr, "Error: At most %d boards are supported\n", MAX_BOARDS);
+                    exit(1);
+                }
+                maps[nr_maps++] = optarg;
+                break;
+            case 'P':
+                players = atoi(optarg);
+                if (players < 1 || players > MAX_PLAYERS) {
+                    fprintf(stderr, "Error: Players must be between 1 and %d\n", MAX_PLAYERS);
+                    exit(1);
+                }
+                break;
+            case 't':
+                tic_cap = atoi(optarg);
+                if (tic_cap < 0 || tic_cap > FRAME_QUEUE_SIZE) {
+                    fprintf(stderr, "Error: Tic cap must be between 0 and %d\n", FRAME_QUEUE_SIZE);
+                    exit(1);
+                }
+                break;
+            case 'y':
+                tic_sync = true;
+                break;
+            case 'L':
+                tic_sync = true;
+                tic_lead_us = atoi(optarg);
+                break;
+            case 'r':
+                rate_limit = atoi(optarg);
+                if (rate_limit < 0 || rate_limit > RATE_LIMIT_MAX) {
+                    fprintf(stderr, "Error: Rate must be between 0 and %d\n", RATE_LIMIT_MAX);
+                    exit(1);
+                }
+                break;
+            case 'B':
+                rate_burst = atoi(optarg);
+                if (rate_burst < 1 || rate_burst > FRAME_QUEUE_SIZE) {
+                    fprintf(stderr, "Error: Burst must be between 1 and %d\n", FRAME_QUEUE_SIZE);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                compact = true;
+                break;
+            case 'k':
+                if (load_keymap(optarg) < 0) {
+                    exit(1);
+                }
+                break;
+            case 'f':
+                fb_output = optarg;
+                break;
+            case 'H':
+                heartbeat_ms = atoi(optarg);
+                break;
+            case 'T':
+                timeout_ms = atoi(optarg);
+                break;
+            case 'A':
+                secret = optarg;
+                break;
+            case 'E':
+                link_errors = atoi(optarg);
+                break;
+            case 'I':
+                probe_interval = atoi(optarg);
+                if (probe_interval < 1) {
+                    fprintf(stderr, "Error: Probe interval must be at least a second\n");
+                    exit(1);
+                }
+                break;
+            case 'K':
+                key_acks = true;
+                break;
+            case 'R':
+                trace_path = optarg;
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                if (workers < 1 || workers > MAX_WORKERS) {
+                    fprintf(stderr, "Error: Workers must be between 1 and %d\n", MAX_WORKERS);
+                    exit(1);
+                }
+                break;
+            case 's':
+                stats_port = atoi(optarg);
+                break;
             case 'v':
                 verbose = true;
                 break;
@@ -235,74 +3922,48 @@ int main(int argc, char *argv[])
         }
     }
 
-    serial_port_fd = open(device, O_RDWR | O_NOCTTY | O_SYNC);
-    if (serial_port_fd < 0) {
-        perror("Error opening serial port");
-        return 1;
+    if (nr_maps == 0) {
+        boards[0].device = device;
+        boards[0].port = port;
+        boards[0].baud = baud;
+        boards[0].spectator_port = spectator_port;
+        boards[0].websocket_port = websocket_port;
+        nr_boards = 1;
     }
 
-    if (configure_serial_port(serial_port_fd, baud) < 0) {
-        return 1;
+    for (int i = 0; i < nr_maps; i++) {
+        if (parse_map(maps[i], &boards[i], baud) < 0) {
+            fprintf(stderr, "Error: Invalid board mapping '%s'\n", maps[i]);
+            exit(1);
+        }
+        nr_boards++;
     }
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("Socket creation failed");
+    if (trace_path && trace_open(trace_path, "forwarder") < 0) {
         return 1;
     }
 
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
+    // A framebuffer reader going away must not take us with it
+    signal(SIGPIPE, SIG_IGN);
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("Bind failed");
-        close(server_fd);
-        close(serial_port_fd);
-        return 1;
+    for (int i = 0; i < nr_boards; i++) {
+        struct board *b = &boards[i];
+        b->index = i;
+        b->stats = &shared->stats[i];
+        b->handoff[0] = b->handoff[1] = -1;
+        shared->routes[i].owner = i % workers;
+        if (workers > 1 && socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, b->handoff) < 0) {
+            perror("socketpair");
+            return 1;
+        }
     }
 
-    if (listen(server_fd, 1) < 0) {
-        perror("Listen failed");
-        close(server_fd);
-        close(serial_port_fd);
-        return 1;
+    if (workers > 1) {
+        return supervise(stats_port);
     }
 
-    printf("Server listening on port %d and forwarding to %s...\n", port, device);
-
-    // Main server loop - accept connections continuously
-    while (1) {
-        int addrlen = sizeof(address);
-        printf("Waiting for connection...\n");
-
-        int new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen);
-        if (new_socket < 0) {
-            perror("Accept failed");
-            continue; // Try to accept next connection instead of exiting
-        }
-        tcp_socket_fd = new_socket;
-
-        printf("Connection accepted from %s:%d. Starting bidirectional forwarding...\n", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
-
-        // Create both threads for bidirectional communication
-        pthread_t tcp_to_serial_thread_handle;
-        pthread_t serial_to_tcp_thread_handle;
-        
-        pthread_create(&tcp_to_serial_thread_handle, NULL, tcp_to_serial_thread, NULL);
-        pthread_create(&serial_to_tcp_thread_handle, NULL, serial_to_tcp_thread, NULL);
-
-        // Wait for the TCP to serial thread to finish
-        pthread_join(tcp_to_serial_thread_handle, NULL);
-
-        pthread_cancel(serial_to_tcp_thread_handle);
-        close(new_socket);
-        printf("Connection closed. Ready for next connection.\n");
+    if (stats_port && stats_start(stats_port) < 0) {
+        return 1;
     }
-
-    // This code will never be reached due to infinite loop, but kept for completeness
-    close(server_fd);
-    close(serial_port_fd);
-    return 0;
+    return worker_run();
 }
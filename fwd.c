@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+
+#include "protocol.h"
+#include "fwd.h"
+
+// Frames queued for the board, plenty for what a single player types
+#define OUT_BUFFER_SIZE 1024
+
+struct fwd {
+    int fd;
+    unsigned char out[OUT_BUFFER_SIZE];
+    size_t out_len;
+    uint8_t held[KEY_CODES / 8];    // Keys the board has down
+    struct fwd_parser parser;
+    unsigned char *record;
+    fwd_record_fn record_fn;
+    void *record_arg;
+};
+
+static speed_t baudrate_to_speed_t(int baudrate)
+{
+    switch (baudrate) {
+        case 50:
+            return B50;
+        case 75:
+            return B75;
+        case 110:
+            return B110;
+        case 134:
+            return B134;
+        case 150:
+            return B150;
+        case 200:
+            return B200;
+        case 300:
+            return B300;
+        case 600:
+            return B600;
+        case 1200:
+            return B1200;
+        case 1800:
+            return B1800;
+        case 2400:
+            return B2400;
+        case 4800:
+            return B4800;
+        case 9600:
+            return B9600;
+        case 19200:
+            return B19200;
+        case 38400:
+            return B38400;
+        case 57600:
+            return B57600;
+        case 115200:
+            return B115200;
+        case 230400:
+            return B230400;
+        case 460800:
+            return B460800;
+        case 500000:
+            return B500000;
+        case 576000:
+            return B576000;
+        case 921600:
+            return B921600;
+        case 1000000:
+            return B1000000;
+        case 1152000:
+            return B1152000;
+        case 1500000:
+            return B1500000;
+        case 2000000:
+            return B2000000;
+        case 2500000:
+            return B2500000;
+        case 3000000:
+            return B3000000;
+        case 3500000:
+            return B3500000;
+        case 4000000:
+            return B4000000;
+        default:
+            fprintf(stderr, "Error: Invalid or unsupported baud rate: %d\n", baudrate);
+            return (speed_t)-1;
+    }
+}
+
+// Function to configure the serial port
+int fwd_serial_configure(int fd, int baud_rate)
+{
+    struct termios tty;
+    if (tcgetattr(fd, &tty) != 0) {
+        perror("Error from tcgetattr");
+        return -1;
+    }
+
+    // Set baud rate
+    speed_t b = baudrate_to_speed_t(baud_rate);
+    if (b == (speed_t)-1) {
+        return -1;
+    }
+    cfsetospeed(&tty, b);
+    cfsetispeed(&tty, b);
+
+    // Set other serial port settings
+    tty.c_cflag &= ~PARENB;      // No parity
+    tty.c_cflag &= ~CSTOPB;      // 1 stop bit
+    tty.c_cflag &= ~CSIZE;       // Clear size bits
+    tty.c_cflag |= CS8;          // 8 data bits
+    tty.c_cflag &= ~CRTSCTS;     // Disable hardware flow control
+    tty.c_cflag |= CREAD | CLOCAL; // Enable reading and ignore modem controls
+
+    tty.c_lflag &= ~ICANON;      // Disable canonical mode
+    tty.c_lflag &= ~ECHO;        // Disable echo
+    tty.c_lflag &= ~ECHOE;       // Disable erase
+    tty.c_lflag &= ~ECHONL;      // Disable newline echo
+    tty.c_lflag &= ~ISIG;        // Disable signal characters
+
+    tty.c_iflag &= ~(IXON | IXOFF | IXANY); // Disable software flow control
+    tty.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL); // Disable special handling
+
+    tty.c_oflag &= ~OPOST;       // Prevent special interpretation of output bytes
+    tty.c_oflag &= ~ONLCR;       // Prevent newline to carriage return conversion
+
+    tty.c_cc[VTIME] = 10;        // Wait for up to 1 second (10 * 0.1s)
+    tty.c_cc[VMIN] = 1;          // Non-blocking read
+
+    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
+        perror("Error from tcsetattr");
+        return -1;
+    }
+
+    return 0;
+}
+
+int fwd_serial_speed(int fd, int baud_rate)
+{
+    struct termios tty;
+    speed_t b = baudrate_to_speed_t(baud_rate);
+
+    if (b == (speed_t)-1 || tcgetattr(fd, &tty) != 0) {
+        return -1;
+    }
+    cfsetospeed(&tty, b);
+    cfsetispeed(&tty, b);
+
+    if (tcsetattr(fd, TCSADRAIN, &tty) != 0) {
+        perror("Error from tcsetattr");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int fwd_serial_open(const char *device, int baud, int flags)
+{
+    int fd = open(device, O_RDWR | O_NOCTTY | flags);
+    if (fd < 0) {
+        fprintf(stderr, "%s: ", device);
+        perror("Error opening serial port");
+        return -1;
+    }
+
+    if (fwd_serial_configure(fd, baud) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int fwd_frame_length(unsigned char identifier)
+{
+    return identifier == PRESS_EXTENDED_IDENTIFIER || identifier == RELEASE_EXTENDED_IDENTIFIER ? 3 : 2;
+}
+
+int fwd_encode_key(unsigned char *out, bool press, int code)
+{
+    if (code > 255) {
+        out[0] = press ? PRESS_EXTENDED_IDENTIFIER : RELEASE_EXTENDED_IDENTIFIER;
+        out[1] = code >> 8;
+        out[2] = code;
+        return 3;
+    }
+
+    out[0] = press ? PRESS_IDENTIFIER : RELEASE_IDENTIFIER;
+    out[1] = code;
+    return 2;
+}
+
+uint16_t fwd_crc16(const unsigned char *data, size_t len)
+{
+    uint16_t crc = 0xffff;
+
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+void fwd_parser_init(struct fwd_parser *p, unsigned char *record)
+{
+    memset(p, 0, sizeof(*p));
+    p->line_start = true;
+    p->record = record;
+}
+
+// One byte of a framebuffer record, the newline finishes it
+static int fwd_record_byte(struct fwd_parser *p, unsigned char c)
+{
+    if (c == '\n') {
+        p->in_record = false;
+        p->line_start = true;
+        return FWD_RECORD;
+    }
+
+    if (p->escaped) {
+        p->escaped = false;
+        c ^= 0x20;
+    } else if (c == FB_ESCAPE) {
+        p->escaped = true;
+        return FWD_HIDDEN;
+    }
+
+    // Too long to be anything valid, just count it until the newline
+    if (p->record_len < FB_RECORD_MAX) {
+        p->record[p->record_len] = c;
+    }
+    p->record_len++;
+    return FWD_HIDDEN;
+}
+
+int fwd_parse(struct fwd_parser *p, unsigned char c)
+{
+    if (p->in_record) {
+        return fwd_record_byte(p, c);
+    }
+
+    if (p->in_marker) {
+        if (c == '\n') {
+            p->in_marker = false;
+            p->line_start = true;
+            return FWD_MARKER;
+        }
+        if (c == ' ') {
+            p->marker_first = p->marker_value;
+            p->marker_value = 0;
+        } else if (c >= '0' && c <= '9') {
+            p->marker_value = p->marker_value * 10 + c - '0';
+        }
+        return FWD_HIDDEN;
+    }
+
+    if (p->line_start && c == FB_RECORD_START) {
+        p->in_record = true;
+        p->escaped = false;
+        p->record_len = 0;
+        return FWD_HIDDEN;
+    }
+    if (p->line_start && (c == TIC_MARKER || c == BAUD_ACK || c == KEY_ACK)) {
+        p->in_marker = true;
+        p->marker = c;
+        p->marker_first = 0;
+        p->marker_value = 0;
+        return FWD_HIDDEN;
+    }
+
+    p->line_start = c == '\n';
+    return FWD_TEXT;
+}
+
+struct fwd *fwd_open(const char *device, int baud)
+{
+    struct fwd *f = calloc(1, sizeof(*f));
+    if (!f) {
+        perror("calloc");
+        return NULL;
+    }
+
+    f->record = malloc(FB_RECORD_MAX);
+    if (!f->record) {
+        perror("malloc");
+        free(f);
+        return NULL;
+    }
+
+    f->fd = fwd_serial_open(device, baud, O_NONBLOCK | O_CLOEXEC);
+    if (f->fd < 0) {
+        free(f->record);
+        free(f);
+        return NULL;
+    }
+    fwd_parser_init(&f->parser, f->record);
+    return f;
+}
+
+void fwd_close(struct fwd *f)
+{
+    // Wait for the releases to go, the board would otherwise keep them down
+    fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) & ~O_NONBLOCK);
+    for (int code = 0; code < KEY_CODES; code++) {
+        if (f->held[code / 8] & (1 << (code % 8))) {
+            if (fwd_key(f, false, code) < 0) {
+                fwd_flush(f);
+                fwd_key(f, false, code);
+            }
+        }
+    }
+    fwd_flush(f);
+    tcdrain(f->fd);
+
+    close(f->fd);
+    free(f->record);
+    free(f);
+}
+
+int fwd_fd(const struct fwd *f)
+{
+    return f->fd;
+}
+
+bool fwd_want_write(const struct fwd *f)
+{
+    return f->out_len != 0;
+}
+
+static int fwd_queue(struct fwd *f, const unsigned char *frame, size_t len)
+{
+    if (f->out_len + len > sizeof(f->out)) {
+        return -1;
+    }
+    memcpy(f->out + f->out_len, frame, len);
+    f->out_len += len;
+    return 0;
+}
+
+int fwd_key(struct fwd *f, bool press, int code)
+{
+    unsigned char frame[3];
+
+    if (code < 0 || code >= KEY_CODES) {
+        return -1;
+    }
+    if (fwd_queue(f, frame, fwd_encode_key(frame, press, code)) < 0) {
+        return -1;
+    }
+
+    if (press) {
+        f->held[code / 8] |= 1 << (code % 8);
+    } else {
+        f->held[code / 8] &= ~(1 << (code % 8));
+    }
+    return 0;
+}
+
+int fwd_control(struct fwd *f, unsigned char identifier, unsigned char arg)
+{
+    unsigned char frame[2] = { identifier, arg };
+    return fwd_queue(f, frame, sizeof(frame));
+}
+
+int fwd_flush(struct fwd *f)
+{
+    while (f->out_len) {
+        ssize_t written = write(f->fd, f->out, f->out_len);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return 0;
+            }
+            perror("Error writing serial port");
+            return -1;
+        }
+        memmove(f->out, f->out + written, f->out_len - written);
+        f->out_len -= written;
+    }
+    return 0;
+}
+
+ssize_t fwd_read(struct fwd *f, char *buf, size_t len)
+{
+    ssize_t bytes_read = read(f->fd, buf, len);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    if (bytes_read <= 0) {
+        if (bytes_read < 0) {
+            perror("Error reading serial port");
+        }
+        return -1;
+    }
+
+    size_t out = 0;
+    for (ssize_t i = 0; i < bytes_read; i++) {
+        int kind = fwd_parse(&f->parser, buf[i]);
+        size_t record_len = f->parser.record_len;
+
+        // Markers are only meaningful to a forwarder that asked for them
+        if (kind == FWD_TEXT) {
+            buf[out++] = buf[i];
+        } else if (kind == FWD_RECORD && f->record_fn && record_len >= 4 && record_len <= FB_RECORD_MAX &&
+                   fwd_crc16(f->record, record_len - 2) ==
+                   (f->record[record_len - 2] << 8 | f->record[record_len - 1])) {
+            f->record_fn(f->record_arg, f->record, record_len - 2);
+        }
+    }
+
+    return out;
+}
+
+void fwd_on_record(struct fwd *f, fwd_record_fn fn, void *arg)
+{
+    f->record_fn = fn;
+    f->record_arg = arg;
+    fwd_control(f, FRAMEBUFFER_IDENTIFIER, fn != NULL);
+}
@@ -0,0 +1,84 @@
+#ifndef FWD_H
+#define FWD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Core of the forwarder, for programs that drive a board themselves.
+//
+// The serial and framing helpers are what forwarder.c is built on. On top
+// of them a struct fwd is a single player talking straight to a board over
+// its serial port, with no forwarder in between. Nothing in here blocks:
+// poll fwd_fd(), call fwd_read() when it is readable and fwd_flush() when
+// fwd_want_write() says there is output waiting.
+
+// Open a serial port and set it up for a board, 8N1 raw at baud. Returns
+// the file descriptor, or -1 with the reason printed.
+int fwd_serial_open(const char *device, int baud, int flags);
+int fwd_serial_configure(int fd, int baud);
+// Change the speed of a configured port, once what was written has gone
+int fwd_serial_speed(int fd, int baud);
+
+// Frame length implied by its identifier
+int fwd_frame_length(unsigned char identifier);
+// Encode a key transition into out, returning its length. Codes above 255
+// need the extended frame.
+int fwd_encode_key(unsigned char *out, bool press, int code);
+
+uint16_t fwd_crc16(const unsigned char *data, size_t len);
+
+// Splits what a board sends into text for the clients, marker lines and
+// framebuffer records, one byte at a time
+struct fwd_parser {
+    bool line_start;        // The next byte starts a line
+    bool in_marker;         // Inside a marker line
+    unsigned char marker;   // Marker of the current or last marker line
+    uint32_t marker_value;
+    uint32_t marker_first;  // Value before a space, for markers with two
+    bool in_record;         // Inside a framebuffer record
+    bool escaped;
+    unsigned char *record;  // Unescaped record, FB_RECORD_MAX bytes
+    size_t record_len;      // Past FB_RECORD_MAX once a record overflows
+};
+
+// What fwd_parse() made of a byte
+#define FWD_TEXT 0          // Board output for the clients
+#define FWD_HIDDEN 1        // Part of a marker line or record
+#define FWD_MARKER 2        // A marker line ended, see marker and its values
+#define FWD_RECORD 3        // A record ended, record_len bytes with its CRC
+
+// record is the caller's, FB_RECORD_MAX bytes
+void fwd_parser_init(struct fwd_parser *p, unsigned char *record);
+int fwd_parse(struct fwd_parser *p, unsigned char c);
+
+struct fwd;
+
+// Called with each framebuffer record that passed its CRC, without the CRC
+typedef void (*fwd_record_fn)(void *arg, const unsigned char *record, size_t len);
+
+struct fwd *fwd_open(const char *device, int baud);
+// Releases whatever keys are still down before closing
+void fwd_close(struct fwd *f);
+
+int fwd_fd(const struct fwd *f);
+bool fwd_want_write(const struct fwd *f);
+
+// Queue a key transition or control frame. Returns -1 if there is no room,
+// fwd_flush() makes some.
+int fwd_key(struct fwd *f, bool press, int code);
+int fwd_control(struct fwd *f, unsigned char identifier, unsigned char arg);
+
+// Write as much queued output as the port takes. Returns -1 on error.
+int fwd_flush(struct fwd *f);
+
+// Read board output, returning the text in buf with framebuffer records
+// and markers taken out. Returns 0 if there was nothing but those, -1 on
+// error or end of file.
+ssize_t fwd_read(struct fwd *f, char *buf, size_t len);
+
+// Ask the board for framebuffer records and have them passed to fn
+void fwd_on_record(struct fwd *f, fwd_record_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+// Client to forwarder frames are two bytes, an identifier followed by
+// its argument. Forwarder to board frames use the same encoding. Clients
+// only send key frames and the ones marked client to forwarder, the
+// forwarder drops anything else.
+#define PRESS_IDENTIFIER 254
+#define RELEASE_IDENTIFIER 255
+// Key codes above 255, such as gamepad buttons, escape to a three byte
+// frame with the code big endian in the two bytes after the identifier.
+// Both directions, the board must understand these too.
+#define PRESS_EXTENDED_IDENTIFIER 248
+#define RELEASE_EXTENDED_IDENTIFIER 247
+
+// Key codes are Linux evdev codes, always below KEY_CNT
+#define KEY_CODES 0x300
+// Sent once over a local socket along with the shared memory ring and
+// doorbell file descriptors. Argument is unused.
+#define SHM_IDENTIFIER 253
+// Forwarder to board only. Key frames that follow are for the given
+// player (0 based), until the next PLAYER_IDENTIFIER frame. Only sent when
+// the forwarder serves more than one player.
+#define PLAYER_IDENTIFIER 252
+// Forwarder to board only. Argument is a bitmask of the player slots that
+// currently have a client connected, sent whenever it changes. Only sent
+// when the forwarder serves more than one player.
+#define PRESENCE_IDENTIFIER 251
+// Client to forwarder only, sent when the client has been idle for its
+// heartbeat interval. Argument is unused. Once a client has sent one the
+// forwarder expects to keep hearing from it and drops it if it goes quiet.
+#define HEARTBEAT_IDENTIFIER 250
+// Client to forwarder only, optionally the first frame on a connection.
+// Argument is the length of a body that follows: the client's identity,
+// then a NUL and a token if the forwarder was given a secret. A newer
+// connection with the same identity takes over the older one's player.
+// A client that is tracing adds a NUL and its connection's trace id in hex
+// (see trace.h), after an empty token if it has none. The identity may be
+// empty then.
+#define HELLO_IDENTIFIER 249
+// Forwarder to board only. An argument of 1 means the forwarder translates
+// key codes with its keymap, so key frames carry Doom key values rather
+// than evdev codes. Sent when the board is opened.
+#define KEYMAP_IDENTIFIER 246
+
+// The forwarder writes this line to its clients whenever the board has
+// been quiet for the heartbeat interval
+#define HEARTBEAT_LINE "H\n"
+
+// Forwarder to board only. An argument of 1 asks the board to stream its
+// framebuffer, starting with a key frame. Sent when the forwarder has
+// somewhere to put frames, and again whenever it has lost a record.
+#define FRAMEBUFFER_IDENTIFIER 245
+
+// Forwarder to board only. An argument of 1 asks the board to send a tic
+// marker line every time it samples its input.
+#define TIC_SYNC_IDENTIFIER 244
+
+// A board to forwarder line starting with TIC_MARKER, followed by the tic
+// number in decimal, marks the moment the board sampled its input for that
+// tic. The forwarder consumes these, clients never see them.
+#define TIC_MARKER 0xfc
+
+// Forwarder to board only, asks the board to move the serial link to
+// BAUD_RATES[argument]. The board answers with a BAUD_ACK line at the old
+// rate and then switches. The forwarder switches when it sees the ack and
+// sends the same frame again at the new rate to confirm. A board that
+// hears no confirmation within a second goes back to the old rate, and a
+// forwarder that sees no ack within a second stays where it is.
+#define BAUD_IDENTIFIER 243
+#define BAUD_ACK 0xfa
+#define BAUD_RATES { 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600 }
+
+// Forwarder to board only. An argument of 1 asks the board to acknowledge
+// key frames. From then on it counts the key frames it applies, modulo
+// 65536, and after each tic in which it applied any sends a KEY_ACK line
+// with that count and the tic number, in decimal separated by a space.
+#define KEY_ACK_IDENTIFIER 242
+#define KEY_ACK 0xf9
+
+// Board to forwarder traffic is newline terminated text, except for
+// framebuffer records. A line starting with FB_RECORD_START is a record
+// and runs to the next newline. Inside it FB_ESCAPE followed by x stands
+// for x ^ 0x20, used for newlines and escape bytes in the data. Unescaped,
+// a record is a type, an 8 bit sequence number incremented per record, the
+// body and a big endian CRC-16/CCITT of everything before it.
+#define FB_RECORD_START 0xfb
+#define FB_ESCAPE 0xfd
+
+// Frames are 8 bit paletted
+#define FB_WIDTH 320
+#define FB_HEIGHT 200
+#define FB_SIZE (FB_WIDTH * FB_HEIGHT)
+// Longest record a board may send, unescaped. A frame's worth of literal
+// ops is the worst case.
+#define FB_RECORD_MAX (FB_SIZE + FB_SIZE / 64 + 16)
+
+// Record types. A palette body is 256 RGB triples. Frame bodies are ops
+// applied to the pixels in row order, a delta frame against the previous
+// frame and a key frame against a black one.
+#define FB_PALETTE 'P'
+#define FB_DELTA_FRAME 'D'
+#define FB_KEY_FRAME 'K'
+
+// Frame ops. 0x00-0x7f skip op + 1 unchanged pixels, 0x80-0xbf set the
+// next (op & 0x3f) + 1 pixels to the following byte, 0xc0-0xff copy the
+// (op & 0x3f) + 1 bytes that follow.
+#define FB_OP_REPEAT 0x80
+#define FB_OP_LITERAL 0xc0
+
+// Browsers connect to the forwarder's WebSocket port and send binary
+// messages holding the same frames as native clients. Each message from
+// the forwarder starts with one of these, followed by board output text
+// (sound and heartbeat lines) or a framebuffer record without its CRC.
+#define WS_TEXT 'T'
+#define WS_FRAMEBUFFER 'F'
+
+// Abstract unix socket a forwarder listens on for co-located clients,
+// formatted with the board's TCP port
+#define UNIX_SOCKET_NAME "doom-forwarder-%s"
+
+// Single producer (client) single consumer (forwarder) ring of frame
+// bytes in shared memory. After publishing head the client writes to an
+// eventfd to wake the forwarder, which drains up to head and publishes
+// tail. Both indexes are free running, only ever use them modulo the
+// ring size.
+#define SHM_RING_SIZE 4096
+
+struct shm_ring {
+    uint32_t head;
+    char pad1[60];      // Keep producer and consumer on separate cache lines
+    uint32_t tail;
+    char pad2[60];
+    unsigned char data[SHM_RING_SIZE];
+};
+
+#endif
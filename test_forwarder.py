@@ -0,0 +1,302 @@
+#!/usr/bin/env python3
+"""
+Tests for the forwarder, run against the binary in this directory with a
+pseudo terminal standing in for the board. The clients are checked against
+a uinput keyboard where the kernel offers one.
+"""
+
+import fcntl
+import os
+import pty
+import random
+import select
+import socket
+import struct
+import subprocess
+import sys
+import time
+import tty
+import unittest
+
+PRESS_IDENTIFIER = 254
+RELEASE_IDENTIFIER = 255
+PRESS_EXTENDED_IDENTIFIER = 248
+RELEASE_EXTENDED_IDENTIFIER = 247
+PLAYER_IDENTIFIER = 252
+PRESENCE_IDENTIFIER = 251
+KEYMAP_IDENTIFIER = 246
+FRAMEBUFFER_IDENTIFIER = 245
+TIC_SYNC_IDENTIFIER = 244
+BAUD_IDENTIFIER = 243
+KEY_ACK_IDENTIFIER = 242
+HELLO_IDENTIFIER = 249
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+FORWARDER = os.path.join(HERE, 'forwarder')
+KEY_A = 30
+
+EV_SYN = 0x00
+EV_KEY = 0x01
+EV_REL = 0x02
+SYN_REPORT = 0
+REL_X = 0x00
+INPUT_EVENT_FORMAT = 'QQHHi'
+
+# From linux/uinput.h
+UINPUT_DEVICE = '/dev/uinput'
+UI_DEV_CREATE = 0x5501
+UI_DEV_DESTROY = 0x5502
+UI_DEV_SETUP = 0x405c5503
+UI_SET_EVBIT = 0x40045564
+UI_SET_KEYBIT = 0x40045565
+UI_SET_RELBIT = 0x40045566
+UI_GET_SYSNAME_64 = 0x8040552c
+BUS_VIRTUAL = 0x06
+UINPUT_SETUP_FORMAT = 'HHHH80sI'
+
+
+def frame_length(identifier):
+    if identifier in (PRESS_EXTENDED_IDENTIFIER, RELEASE_EXTENDED_IDENTIFIER):
+        return 3
+    return 2
+
+
+class Board:
+    """A pseudo terminal the forwarder opens as its board's serial port."""
+
+    def __init__(self):
+        self.master, self.slave = pty.openpty()
+        tty.setraw(self.master)
+        self.device = os.ttyname(self.slave)
+        self.pending = b''
+
+    def close(self):
+        os.close(self.master)
+        os.close(self.slave)
+
+    def frames(self, timeout):
+        """Frames the forwarder writes within timeout seconds."""
+        deadline = time.monotonic() + timeout
+        frames = []
+        while True:
+            left = deadline - time.monotonic()
+            if left <= 0 or not select.select([self.master], [], [], left)[0]:
+                break
+            self.pending += os.read(self.master, 4096)
+            while self.pending and len(self.pending) >= frame_length(self.pending[0]):
+                length = frame_length(self.pending[0])
+                frames.append(tuple(self.pending[:length]))
+                self.pending = self.pending[length:]
+        return frames
+
+
+class ForwarderTest(unittest.TestCase):
+    def setUp(self):
+        self.board = Board()
+        self.port = random.randint(20000, 60000)
+        self.stats_port = self.port + 1
+        self.websocket_port = self.port + 2
+        self.forwarder = subprocess.Popen(
+            [FORWARDER, '-m', f'{self.board.device}:{self.port}:115200:0:{self.websocket_port}',
+             '-s', str(self.stats_port), '--ws-origin', 'http://allowed.example',
+             '--link-errors', '0', '-H', '0'],
+            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        self.addCleanup(self.board.close)
+        self.addCleanup(self.forwarder.wait)
+        self.addCleanup(self.forwarder.kill)
+
+        for _ in range(50):
+            try:
+                self.client = socket.create_connection(('127.0.0.1', self.port))
+                break
+            except ConnectionRefusedError:
+                time.sleep(0.05)
+        else:
+            self.fail("forwarder never started listening")
+        self.addCleanup(self.client.close)
+        # Whatever the forwarder sends a board it has just opened
+        self.board.frames(0.2)
+
+    def stat(self, name):
+        with socket.create_connection(('127.0.0.1', self.stats_port)) as s:
+            text = b''
+            while chunk := s.recv(65536):
+                text += chunk
+        for line in text.decode().splitlines():
+            if line.startswith(f'forwarder_{name}{{'):
+                return int(line.split()[-1])
+        self.fail(f"no {name} statistic")
+
+    def websocket(self, origin=None):
+        """Open a WebSocket, returning the socket, status line and what followed."""
+        s = socket.create_connection(('127.0.0.1', self.websocket_port))
+        self.addCleanup(s.close)
+        request = (f'GET / HTTP/1.1\r\nHost: 127.0.0.1:{self.websocket_port}\r\n'
+                   'Upgrade: websocket\r\nConnection: Upgrade\r\n'
+                   'Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n')
+        if origin:
+            request += f'Origin: {origin}\r\n'
+        s.sendall((request + '\r\n').encode())
+        response = self.receive(s, 0.3)
+        status, _, body = response.partition(b'\r\n')
+        return s, status, body.partition(b'\r\n\r\n')[2]
+
+    @staticmethod
+    def receive(s, timeout):
+        data = b''
+        while select.select([s], [], [], timeout)[0]:
+            chunk = s.recv(65536)
+            if not chunk:
+                break
+            data += chunk
+        return data
+
+    @staticmethod
+    def message_types(data):
+        """Types of the unmasked binary messages in data."""
+        types = []
+        while data:
+            length, header = data[1] & 0x7f, 2
+            if length == 126:
+                length, header = int.from_bytes(data[2:4], 'big'), 4
+            types.append(chr(data[header]))
+            data = data[header + length:]
+        return types
+
+    def assert_only_key_reaches_board(self, frame):
+        self.client.sendall(bytes(frame) + bytes([PRESS_IDENTIFIER, KEY_A]))
+        frames = self.board.frames(0.3)
+        self.assertEqual(frames, [(PRESS_IDENTIFIER, KEY_A)])
+        self.assertEqual(self.stat('frames_rejected'), 1)
+
+    def test_player_frame_dropped(self):
+        self.assert_only_key_reaches_board((PLAYER_IDENTIFIER, 3))
+
+    def test_baud_frame_dropped(self):
+        self.assert_only_key_reaches_board((BAUD_IDENTIFIER, 7))
+
+    def test_board_control_frames_dropped(self):
+        control = [PRESENCE_IDENTIFIER, KEYMAP_IDENTIFIER, FRAMEBUFFER_IDENTIFIER,
+                   TIC_SYNC_IDENTIFIER, KEY_ACK_IDENTIFIER]
+        for identifier in control:
+            self.client.sendall(bytes([identifier, 1]))
+        self.client.sendall(bytes([PRESS_EXTENDED_IDENTIFIER, 0x01, 0x20,
+                                   RELEASE_IDENTIFIER, KEY_A]))
+        frames = self.board.frames(0.3)
+        self.assertEqual(frames, [(PRESS_EXTENDED_IDENTIFIER, 0x01, 0x20), (RELEASE_IDENTIFIER, KEY_A)])
+        self.assertEqual(self.stat('frames_rejected'), len(control))
+
+    def test_takeover_releases_held_keys(self):
+        hello = bytes([HELLO_IDENTIFIER, 2]) + b'me'
+        self.client.sendall(hello + bytes([PRESS_IDENTIFIER, KEY_A]))
+        self.assertEqual(self.board.frames(0.3), [(PRESS_IDENTIFIER, KEY_A)])
+        replacement = socket.create_connection(('127.0.0.1', self.port))
+        self.addCleanup(replacement.close)
+        replacement.sendall(hello)
+        self.assertEqual(self.board.frames(0.3), [(RELEASE_IDENTIFIER, KEY_A)])
+        self.assertEqual(self.stat('takeovers'), 1)
+
+    def test_marker_lines_hidden(self):
+        os.write(self.board.master, b'\xf91 2\nP1\n\xfc5\nP2\n\xfa3\nP3\n')
+        self.assertEqual(self.receive(self.client, 0.3), b'P1\nP2\nP3\n')
+
+    def test_websocket_origins(self):
+        for origin, allowed in [(None, True), (f'http://127.0.0.1:{self.websocket_port}', True),
+                                ('http://allowed.example', True), ('http://evil.example', False),
+                                ('http://127.0.0.1:1', False)]:
+            with self.subTest(origin=origin):
+                _, status, _ = self.websocket(origin)
+                self.assertIn(b' 101 ' if allowed else b' 403 ', status)
+        self.assertEqual(self.stat('websockets_refused'), 2)
+
+    def test_palette_only_to_new_websocket(self):
+        first, _, body = self.websocket()
+        self.assertEqual(self.message_types(body), ['F'])
+        second, _, body = self.websocket()
+        self.assertEqual(self.message_types(body), ['F'])
+        self.assertNotIn('F', self.message_types(self.receive(first, 0.3)))
+
+
+class Uinput:
+    """A virtual keyboard with a mouse on it, like a combo receiver."""
+
+    def __init__(self):
+        self.fd = os.open(UINPUT_DEVICE, os.O_WRONLY)
+        try:
+            fcntl.ioctl(self.fd, UI_SET_EVBIT, EV_KEY)
+            fcntl.ioctl(self.fd, UI_SET_KEYBIT, KEY_A)
+            fcntl.ioctl(self.fd, UI_SET_EVBIT, EV_REL)
+            fcntl.ioctl(self.fd, UI_SET_RELBIT, REL_X)
+            fcntl.ioctl(self.fd, UI_DEV_SETUP,
+                        struct.pack(UINPUT_SETUP_FORMAT, BUS_VIRTUAL, 0, 0, 0, b'test keyboard', 0))
+            fcntl.ioctl(self.fd, UI_DEV_CREATE)
+            sysname = fcntl.ioctl(self.fd, UI_GET_SYSNAME_64, bytes(64)).rstrip(b'\0').decode()
+            self.path = self.event_node(sysname)
+        except OSError:
+            os.close(self.fd)
+            raise
+
+    @staticmethod
+    def event_node(sysname):
+        sysfs = f'/sys/devices/virtual/input/{sysname}'
+        deadline = time.monotonic() + 2
+        while time.monotonic() < deadline:
+            for name in os.listdir(sysfs):
+                path = f'/dev/input/{name}'
+                if name.startswith('event') and os.access(path, os.R_OK):
+                    return path
+            time.sleep(0.01)
+        raise OSError(f'No event node for {sysname}')
+
+    def write(self, *events):
+        now = time.time()
+        sec, usec = int(now), int(now % 1 * 1000000)
+        os.write(self.fd, b''.join(struct.pack(INPUT_EVENT_FORMAT, sec, usec, *event)
+                                   for event in events + ((EV_SYN, SYN_REPORT, 0),)))
+
+    def close(self):
+        fcntl.ioctl(self.fd, UI_DEV_DESTROY)
+        os.close(self.fd)
+
+
+@unittest.skipUnless(os.access(UINPUT_DEVICE, os.W_OK), 'needs a writable /dev/uinput')
+class ClientTest(unittest.TestCase):
+    """Both clients mask the device's events in the kernel, keys must still get through."""
+
+    def setUp(self):
+        self.device = Uinput()
+        self.addCleanup(self.device.close)
+        self.listener = socket.create_server(('127.0.0.1', 0))
+        self.addCleanup(self.listener.close)
+
+    def forwarded(self, command):
+        port = str(self.listener.getsockname()[1])
+        client = subprocess.Popen(command + ['-p', port, '-d', self.device.path, '-i', '0'],
+                                  stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        self.addCleanup(client.wait)
+        self.addCleanup(client.kill)
+        self.listener.settimeout(5)
+        conn, _ = self.listener.accept()
+        self.addCleanup(conn.close)
+        # Give the client time to open and mask the device after connecting
+        ForwarderTest.receive(conn, 0.3)
+        self.device.write((EV_REL, REL_X, 5))
+        self.device.write((EV_KEY, KEY_A, 1))
+        self.device.write((EV_REL, REL_X, -5), (EV_KEY, KEY_A, 0))
+        return ForwarderTest.receive(conn, 0.5)
+
+    def assert_keys_forwarded(self, command):
+        data = self.forwarded(command)
+        press, release = bytes([PRESS_IDENTIFIER, KEY_A]), bytes([RELEASE_IDENTIFIER, KEY_A])
+        self.assertIn(press, data)
+        self.assertIn(release, data[data.index(press):])
+
+    def test_c_client(self):
+        self.assert_keys_forwarded([os.path.join(HERE, 'client'), '-h', '127.0.0.1'])
+
+    def test_python_client(self):
+        self.assert_keys_forwarded([sys.executable, os.path.join(HERE, 'client.py'), '-H', '127.0.0.1'])
+
+
+if __name__ == '__main__':
+    unittest.main()
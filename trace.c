@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "trace.h"
+
+bool trace_enabled;
+static int trace_fd = -1;
+
+static void trace_write(const char *line, int len)
+{
+    if (len >= 0 && write(trace_fd, line, len) < 0) {
+        perror("trace");
+        trace_enabled = false;
+    }
+}
+
+// Copy s into out as the inside of a JSON string. Names come from device
+// paths and the like, a quote or backslash in one would break the trace.
+static const char *trace_escape(char *out, size_t size, const char *s)
+{
+    size_t len = 0;
+
+    for (; *s; s++) {
+        unsigned char c = *s;
+        char esc[8];
+        int n;
+
+        if (c == '"' || c == '\\') {
+            n = snprintf(esc, sizeof(esc), "\\%c", c);
+        } else if (c < 0x20) {
+            n = snprintf(esc, sizeof(esc), "\\u%04x", c);
+        } else {
+            esc[0] = c;
+            n = 1;
+        }
+        // Cut short rather than split an escape
+        if (len + n >= size) {
+            break;
+        }
+        memcpy(out + len, esc, n);
+        len += n;
+    }
+    out[len] = '\0';
+    return out;
+}
+
+static void trace_metadata(const char *kind, const char *name)
+{
+    char line[256];
+    char escaped[128];
+
+    if (!trace_enabled) {
+        return;
+    }
+    trace_write(line, snprintf(line, sizeof(line),
+                "{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                kind, getpid(), gettid(), trace_escape(escaped, sizeof(escaped), name)));
+}
+
+int trace_open(const char *path, const char *process)
+{
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (trace_fd < 0) {
+        perror("Failed to open trace");
+        return -1;
+    }
+    trace_enabled = true;
+
+    // Start the array if we are first, others just keep adding to it
+    if (lseek(trace_fd, 0, SEEK_END) == 0) {
+        trace_write("[\n", 2);
+    }
+    trace_process(process);
+    return 0;
+}
+
+void trace_process(const char *name)
+{
+    trace_metadata("process_name", name);
+}
+
+void trace_thread(const char *name)
+{
+    trace_metadata("thread_name", name);
+}
+
+uint64_t trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_event(const char *name, const char *cat, uint64_t start, uint64_t end,
+                 uint64_t id, int flow, const char *args)
+{
+    char line[512];
+    char escaped_name[64], escaped_cat[32];
+    uint64_t dur = end > start ? end - start : 0;
+    int len;
+
+    if (!trace_enabled) {
+        return;
+    }
+
+    // Times are in microseconds, keep the nanoseconds as decimals
+    len = snprintf(line, sizeof(line),
+                   "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,"
+                   "\"pid\":%d,\"tid\":%d",
+                   trace_escape(escaped_name, sizeof(escaped_name), name),
+                   trace_escape(escaped_cat, sizeof(escaped_cat), cat), (unsigned long long)(start / 1000), (unsigned long long)(start % 1000),
+                   (unsigned long long)(dur / 1000), (unsigned long long)(dur % 1000), getpid(), gettid());
+    if (id && len < (int)sizeof(line)) {
+        len += snprintf(line + len, sizeof(line) - len, ",\"bind_id\":\"0x%llx\",\"flow_in\":%s,\"flow_out\":%s",
+                        (unsigned long long)id, flow & TRACE_FLOW_IN ? "true" : "false",
+                        flow & TRACE_FLOW_OUT ? "true" : "false");
+    }
+    if (len < (int)sizeof(line)) {
+        len += snprintf(line + len, sizeof(line) - len, ",\"args\":{%s}},\n", args ? args : "");
+    }
+    if (len >= (int)sizeof(line)) {
+        return;
+    }
+    trace_write(line, len);
+}
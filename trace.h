@@ -0,0 +1,54 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Chrome trace event output, for ui.perfetto.dev or chrome://tracing.
+//
+// Events are appended to a file one per line in the JSON array format, with
+// a single write each so several threads and processes can share the file.
+// Viewers load such a file as it is. tracing.py merges the files from several
+// programs into one trace.
+//
+// The steps a key press or sound goes through share a flow id, so the viewer
+// links them up across programs. A key's id is its connection's id in the
+// top half and the number of key frames sent on the connection before it in
+// the bottom half. A tracing client picks a random connection id and sends
+// it in its HELLO. Other connections get the client's TCP port, or
+// TRACE_UNIX_CONN plus its pid over the unix socket. A sound's id is the
+// board and the offset of its line in the board's output.
+
+#define TRACE_FLOW_IN 1
+#define TRACE_FLOW_OUT 2
+
+#define TRACE_UNIX_CONN 0x10000
+
+extern bool trace_enabled;
+
+// Start appending to path, naming this process in the trace. Returns -1
+// with the reason printed.
+int trace_open(const char *path, const char *process);
+// Name the calling process or thread, e.g. after a fork
+void trace_process(const char *name);
+void trace_thread(const char *name);
+
+// Wall clock time in ns, so traces taken on different hosts line up
+uint64_t trace_now(void);
+
+// A step from start to end, tied to others with the same id unless it is
+// 0. args is the inside of a JSON object, or NULL.
+void trace_event(const char *name, const char *cat, uint64_t start, uint64_t end,
+                 uint64_t id, int flow, const char *args);
+
+static inline uint64_t trace_key_id(uint32_t conn, uint32_t seq)
+{
+    return (uint64_t)conn << 32 | seq;
+}
+
+static inline uint64_t trace_sound_id(int board, uint64_t offset)
+{
+    return 1ULL << 63 | (uint64_t)board << 48 | (offset & ((1ULL << 48) - 1));
+}
+
+#endif
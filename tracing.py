@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+"""
+Chrome trace events, for ui.perfetto.dev or chrome://tracing.
+
+Trace writes the same files as trace.c, so client.py and audio.py can add
+to a trace alongside the C programs. Run as a program this merges the
+traces of several programs into one:
+
+    tracing.py merge -o merged.json forwarder.json client.json
+
+A key press is tied together across programs by an id each of them can
+work out, its connection and how many key frames came before it. A tracing
+client picks a random id for its connection and tells the forwarder in its
+HELLO. A sound is tied by where its line is in the board's output. A
+client only knows that relative to when it connected, so merging fills in
+its sound ids from the forwarder's connect events for the same id.
+"""
+
+import argparse
+import bisect
+import json
+import os
+import sys
+import threading
+import time
+
+FLOW_IN = 1
+FLOW_OUT = 2
+
+
+def key_id(conn: int, seq: int) -> int:
+    return conn << 32 | seq
+
+
+def sound_id(board: int, offset: int) -> int:
+    return 1 << 63 | board << 48 | (offset & ((1 << 48) - 1))
+
+
+def now() -> int:
+    """Wall clock time in ns, so traces taken on different hosts line up."""
+    return time.time_ns()
+
+
+class Trace:
+    """Appends events to a trace file, one write per event."""
+    def __init__(self, path: str, process: str):
+        self.fd = os.open(path, os.O_WRONLY | os.O_CREAT | os.O_APPEND, 0o644)
+        # Start the array if we are first, others just keep adding to it
+        if os.lseek(self.fd, 0, os.SEEK_END) == 0:
+            os.write(self.fd, b"[\n")
+        self._metadata("process_name", process)
+
+    def _write(self, event: dict) -> None:
+        os.write(self.fd, json.dumps(event, separators=(',', ':')).encode() + b",\n")
+
+    def _metadata(self, kind: str, name: str) -> None:
+        self._write({"name": kind, "ph": "M", "pid": os.getpid(),
+                     "tid": threading.get_native_id(), "args": {"name": name}})
+
+    def thread(self, name: str) -> None:
+        """Name the calling thread."""
+        self._metadata("thread_name", name)
+
+    def event(self, name: str, cat: str, start: int, end: int, id: int = 0, flow: int = 0,
+              args: dict = None) -> None:
+        """A step from start to end, tied to others with the same id."""
+        event = {"name": name, "cat": cat, "ph": "X", "ts": start / 1000,
+                 "dur": max(end - start, 0) / 1000, "pid": os.getpid(),
+                 "tid": threading.get_native_id()}
+        if id:
+            event["bind_id"] = hex(id)
+        # Sounds a client traces get their id when merged
+        if flow:
+            event["flow_in"] = bool(flow & FLOW_IN)
+            event["flow_out"] = bool(flow & FLOW_OUT)
+        event["args"] = args or {}
+        self._write(event)
+
+
+def load(path: str) -> list:
+    """Events from a trace file, finished or still being written to."""
+    with open(path) as f:
+        text = f.read().strip()
+    if text.startswith('{'):
+        return json.loads(text)["traceEvents"]
+    # An array that may lack its closing bracket and end with a comma
+    text = text.lstrip('[').rstrip(']').strip().rstrip(',')
+    return json.loads('[' + text + ']')
+
+
+def merge(args) -> int:
+    """Merge trace files, tying clients' sounds to the board's."""
+    events = []
+    for path in args.traces:
+        try:
+            events += load(path)
+        except (OSError, ValueError) as e:
+            print(f"Can't read {path}: {e}", file=sys.stderr)
+            return 1
+
+    # Connections without a trace id of their own go by their port, which
+    # gets reused, so each is the last connect before it
+    connects = {}
+    for e in events:
+        if e.get("name") == "connect" and e.get("cat") == "session":
+            connects.setdefault(e["args"]["conn"], []).append(
+                (e["ts"], e["args"]["board"], e["args"]["cursor"]))
+    for c in connects.values():
+        c.sort()
+
+    tied = untied = 0
+    for e in events:
+        a = e.get("args", {})
+        if e.get("cat") != "sound" or "bind_id" in e or "conn" not in a or "offset" not in a:
+            continue
+        c = connects.get(a["conn"], [])
+        if not c:
+            untied += 1
+            continue
+        # A client's clock a little behind the forwarder's still has its connection
+        i = bisect.bisect_right(c, (e["ts"], float('inf'), float('inf'))) - 1
+        _, board, cursor = c[max(i, 0)]
+        e["bind_id"] = hex(sound_id(board, cursor + a["offset"]))
+        tied += 1
+
+    events.sort(key=lambda e: e.get("ts", 0))
+    with open(args.output, "w") as f:
+        json.dump({"traceEvents": events, "displayTimeUnit": "ns"}, f)
+
+    print(f"{len(events)} events from {len(args.traces)} traces written to {args.output}, "
+          f"{tied} client sound events tied to the board's")
+    if untied:
+        print(f"{untied} sound events had no forwarder connection to go with", file=sys.stderr)
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Work with Chrome traces of the input path")
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    p = commands.add_parser("merge", help=merge.__doc__)
+    p.add_argument(
+        "-o", "--output",
+        default="merged.json",
+        help="Where to write the merged trace (default: merged.json)"
+    )
+    p.add_argument(
+        "traces",
+        nargs="+",
+        help="Trace files written by the forwarder, clients and audio"
+    )
+    p.set_defaults(func=merge)
+
+    args = parser.parse_args()
+    sys.exit(args.func(args))
+
+
+if __name__ == "__main__":
+    main()